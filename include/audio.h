@@ -3,6 +3,8 @@
 
 #include "common.h"
 #include "memory.h"
+#include "blip.h"
+#include "recorder.h"
 
 #include <stdint.h>
 #include <SDL2/SDL.h>
@@ -10,6 +12,10 @@
 // Comment this out to use signed 16 bit int audio format
 #define FLOAT32_AUDIO
 
+// Comment this out to sample at a fixed rate, and let the audio latency
+// drift with the difference between the emulator's and the device's clocks
+#define DYNAMIC_RATE_CONTROL
+
 /**
  * The GameBoy has 4 sound channels:
  *  1. Square wave with sweep and envelope functions
@@ -46,7 +52,20 @@
 
 #define WAVE_PATTERN_RAM 0xFF30 // $FF30 - $FF3F
 
-#define AUDIO_BUFFER_LENGTH 0x800
+// Samples the ring between the emulator and the audio device holds, each
+// one {left, right}. Has to be a power of 2
+#define AUDIO_RING_LENGTH 0x2000
+
+// Samples the audio device asks for at a time
+#define AUDIO_DEVICE_SAMPLES 512
+
+// How far ahead of the audio device the emulator stays, by default. Less
+// is more responsive, more is safer against the emulator falling behind
+#define AUDIO_LATENCY_MS 40
+
+// Most the sample rate is nudged by to keep the ring at the latency, as a
+// fraction of it. Small enough that the change in pitch can't be heard
+#define AUDIO_RATE_CONTROL 0.005
 
 #ifdef FLOAT32_AUDIO
 typedef float AudioSample;
@@ -54,29 +73,120 @@ typedef float AudioSample;
 typedef int16_t AudioSample;
 #endif // FLOAT32_AUDIO
 
+/**
+ * One sound channel's state. A channel's output only changes when its
+ * timer runs out and it takes a step (through the duty cycle, the wave
+ * RAM, or the LFSR), or when the frame sequencer changes its volume or
+ * turns it off.
+ */
 typedef struct{
+    bool enabled;
+    int timer;     // Cycles until the next step
+    int period;    // Cycles per step
+    int step;      // Square: 0-7 through the duty cycle. Wave: 0-31 through wave RAM
+    WORD lfsr;     // Noise: the linear feedback shift register, bit 0 is the output
+    int volume;    // 0-15. Not used by the wave channel, NR32 sets its volume
+    int envelope_timer; // Envelope clocks until the next volume step
+    int length;    // Length clocks until the channel turns off, if NRx4 bit 6 is set
+    int output;    // What the channel is putting out, 0-15
+} CHANNEL;
+
+// Sound registers, $FF10 - $FF3F
+#define APU_REGISTERS 0x30
+
+/**
+ * The channels don't produce samples themselves. Every time a channel's
+ * output changes, the change goes into a stereo blip buffer (left and
+ * right) at the cycle it happened, and APU_EndFrame turns the whole frame's
+ * changes into band-limited samples at once. So the channels only do work
+ * as often as their outputs change, not at the sample rate, and there's no
+ * aliasing from sampling them.
+ *
+ * The APU doesn't run alongside the CPU. It's behind until something needs
+ * it to be up to date: a write to one of its registers (which has to take
+ * effect at the right cycle), or the end of the frame. Then it catches up
+ * to the clock it's given, which counts the cycles run so far this frame.
+ * Since the channels' outputs only change at their own events, running
+ * them over a whole frame at once is no more work than running them an
+ * instruction at a time. The frame sequencer is one more event: every
+ * 8192 cycles (512 Hz) it clocks the length counters, the envelopes and
+ * channel 1's sweep, which is where the channels' runs are split up.
+ *
+ * The APU doesn't need an audio device. Without one (APU_OpenDevice isn't
+ * called or fails) it still runs, and a recorder still gets its output.
+ * With neither, nothing is listening and it makes no output at all: the
+ * channels' timers stand still, and catching up only works out what the
+ * frame sequencer's steps did to the lengths, envelopes and sweep since
+ * last time, all at once. That's all a game can see through NR52 and the
+ * other registers, so it still sees the same thing. Catching up happens
+ * on the same events, plus reads of NR52.
+ *
+ * Samples go to the audio device through a ring buffer, with one thread on
+ * each end: APU_EndFrame writes samples and moves head, and the device's
+ * callback reads them and moves tail. Neither one ever waits on the other.
+ * When the ring is full, new samples are dropped; when it runs dry, the
+ * device plays silence until there's latency worth of samples again.
+ *
+ * With DYNAMIC_RATE_CONTROL, neither should happen once playback starts.
+ * The emulator's and the device's clocks never quite agree, so every frame
+ * the sample rate is raised or lowered in proportion to how far the ring
+ * is below or above the latency, which keeps it there.
+ */
+typedef struct apu{
     SDL_AudioSpec audio_spec;
-    AudioSample audio_buffer[AUDIO_BUFFER_LENGTH]; // samples stored as {left-channel, right-channel}
-    int sample_number; // current spot in audio_buffer
-    int sample_timer; // only sample audio when this timer reaches 0 (cycles)
-    int sound_timer[4]; // in cycles
-    int sequence[2]; // Both square wave channels have 8 states depending on the duty
-    int frame_countdown[2]; // frame_timer is set to this value when it hits 0
-    int frame_timer[2]; // the corresponding square wave sequence is incremented when this hits 0
-    bool envelope_enable[2];
-    int envelope_value[2]; // current volume of channels 1 and 2
-    int envelope_timer[2]; // in cycles
-    BYTE nr51;
+    SDL_AudioDeviceID device;
+    AudioSample ring[AUDIO_RING_LENGTH][2]; // {left, right}
+    SDL_atomic_t head;     // Samples written to the ring so far
+    SDL_atomic_t tail;     // Samples read from the ring so far
+    int latency;           // Samples in the ring before playback starts
+    bool playing;          // Only used by the callback
+    unsigned int overruns; // Samples dropped because the ring was full
+    SDL_atomic_t underruns; // Samples of silence played because the ring ran dry
+    BLIP_BUFFER *blip;     // Only gets changes while there's a device
+    const unsigned int *clock; // Cycles run so far this frame
+    unsigned int time;     // Cycles of this frame the APU has run
+    int mixed[2];          // The mixed level of each side, {left, right}
+    CHANNEL channel[4];
+    int sequencer_timer;   // Cycles until the frame sequencer's next step
+    int sequencer_step;    // 0-7
+    int sweep_timer;       // Sweep clocks until channel 1's frequency changes
+    int sweep_frequency;   // Channel 1's frequency as the sweep sees it
+    bool sweep_enabled;
+    BYTE regs[APU_REGISTERS]; // Last value written to each register
+    RECORDER *recorder;
     MEMORY *memory;
 } APU;
 
 
 APU *APU_Create();
 
+// Starts playing on the default audio device. Returns false if it can't
+bool APU_OpenDevice(APU *a);
+
+// Sends the output to r too, from now on. NULL to stop
+void APU_SetRecorder(APU *a, RECORDER *r);
+
 void APU_Destroy(APU *a);
 
 void APU_SetMemory(APU *a, MEMORY *mem);
 
-void APU_Update(APU *a, int cycles);
+// Takes the sound registers' values after the boot ROM from memory
+void APU_Startup(APU *a);
+
+// The APU runs up to *clock whenever it catches up
+void APU_SetClock(APU *a, const unsigned int *clock);
+
+// Catches up, then writes to one of the sound registers
+void APU_WriteRegister(APU *a, WORD addr, BYTE data);
+
+// Reads one of the sound registers. NR52 catches up first
+BYTE APU_ReadRegister(APU *a, WORD addr);
+
+// Catches up and turns the frame's output into samples for the audio
+// device. The clock starts over from 0 after this
+void APU_EndFrame(APU *a);
+
+// How far ahead of the audio device to stay, in milliseconds
+void APU_SetLatency(APU *a, int ms);
 
 #endif // AUDIO_H
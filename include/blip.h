@@ -0,0 +1,69 @@
+#ifndef BLIP_H
+#define BLIP_H
+
+#include "common.h"
+
+#include <stdint.h>
+
+// Samples of output each step is spread over
+#define BLIP_WIDTH 16
+
+// Positions between two samples a step can start at
+#define BLIP_PHASE_BITS 6
+#define BLIP_PHASES     (1 << BLIP_PHASE_BITS)
+
+// Most samples a frame can produce
+#define BLIP_BUFFER_SIZE 4096
+
+// Fractional bits of the step table, and of the sums built from it. Both
+// the table and the steps have to fit in 16 bits
+#define BLIP_DELTA_BITS 15
+
+// The output is high-pass filtered to remove DC. Higher is a lower cutoff
+#define BLIP_BASS_SHIFT 9
+
+
+/**
+ * Turns a stereo signal described by its changes into samples, without
+ * the aliasing of just sampling it. Whoever produces the signal adds the
+ * size of every step it takes, on each side, and the clock cycle it
+ * happens at. Each step is drawn into the buffer as a band-limited step
+ * (from a table of windowed sinc impulses, one per phase), so the buffer
+ * only does work when the signal changes, and the samples for a whole
+ * frame are summed up at once at the end of it.
+ *
+ * Both sides go through together, left and right next to each other, so
+ * a step on both sides is one pass over the taps, and with SSE2 or AVX2
+ * every pass does 2 or 4 taps of both sides at once.
+ *
+ * Times are clock cycles from the start of the current frame.
+ */
+typedef struct{
+    uint64_t factor;    // Samples per clock cycle, 32.32 fixed point
+    uint64_t offset;    // Where the frame starts, in samples, 32.32 fixed point
+    int available;      // Samples finished and not read yet
+    int integrator[2];  // Running sums of the buffer, the current output
+    int buffer[BLIP_BUFFER_SIZE + BLIP_WIDTH][2]; // Differences between samples, {left, right}
+} BLIP_BUFFER;
+
+
+BLIP_BUFFER *Blip_Create();
+
+void Blip_Destroy(BLIP_BUFFER *b);
+
+// Sets how many clock cycles make up how many samples. Can be changed
+// between frames to fine tune the sample rate
+void Blip_SetRates(BLIP_BUFFER *b, double clock_rate, double sample_rate);
+
+// The signal goes up by left and right (down, if negative) at time. Each
+// has to be between -32767 and 32767
+void Blip_AddDelta(BLIP_BUFFER *b, unsigned int time, int left, int right);
+
+// Ends the frame at time, which becomes time 0 of the next one. The
+// samples before it can then be read
+void Blip_EndFrame(BLIP_BUFFER *b, unsigned int time);
+
+// Reads up to count finished samples into out. Returns how many were read
+int Blip_ReadSamples(BLIP_BUFFER *b, int16_t out[][2], int count);
+
+#endif // BLIP_H
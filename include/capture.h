@@ -0,0 +1,87 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "common.h"
+#include "display.h"
+
+#include <stdio.h>
+
+// Frames waiting for the writer thread. When it's this far behind, new
+// frames are dropped instead of holding up emulation
+#define CAPTURE_QUEUE_SIZE 16
+
+// Frames in the shared memory ring
+#define CAPTURE_SHM_SLOTS 8
+
+// A frame at 2 bits per pixel
+#define CAPTURE_FRAME_BYTES (SCREEN_WIDTH * SCREEN_HEIGHT / 4)
+
+typedef enum{
+    CAPTURE_RAW, // Packed shades, 4 pixels per byte with the first in the top 2 bits
+    CAPTURE_Y4M, // YUV4MPEG2, 4:4:4, for piping into an encoder
+    CAPTURE_PNG, // One indexed PNG per frame
+    CAPTURE_SHM  // Shared memory ring of RGBA frames, for an encoder process
+} CAPTURE_FORMAT;
+
+/**
+ * Start of the CAPTURE_SHM shared memory object. CAPTURE_SHM_SLOTS frames
+ * of PIXEL[height][width] follow it. The emulator writes frame number head
+ * into slot head % slot_count, then increments head. The reader increments
+ * tail once it's done with a slot. Frames that would overwrite a slot the
+ * reader hasn't finished with are dropped.
+ */
+typedef struct{
+    char magic[8]; // "GBEMUCAP"
+    unsigned int width;
+    unsigned int height;
+    unsigned int slot_count;
+    unsigned int slot_size; // In bytes
+    SDL_atomic_t head;
+    SDL_atomic_t tail;
+} CAPTURE_SHM_HEADER;
+
+struct capture_shm;
+
+/**
+ * Writes every frame the PPU draws. The PPU hands frames over
+ * packed at 2 bits per pixel (or straight into shared memory for
+ * CAPTURE_SHM), and a writer thread turns them into the output format and
+ * writes them, so slow disks and pipes don't slow down emulation.
+ */
+typedef struct capture{
+    CAPTURE_FORMAT format;
+    FILE *file;         // RAW and Y4M
+    bool pipe;          // file was opened with popen
+    char *path;         // PNG file name pattern
+    unsigned int frames;  // Frames handed over so far
+    unsigned int dropped; // Of those, the ones that didn't fit in the queue
+    SDL_Thread *writer;
+    SDL_sem *wake;
+    SDL_atomic_t quit;
+    SDL_atomic_t head;  // Frames queued so far
+    SDL_atomic_t tail;  // Frames written so far
+    struct{
+        BYTE shades[CAPTURE_FRAME_BYTES];
+        unsigned int colors[4]; // What each shade looked like
+        unsigned int number;
+    } queue[CAPTURE_QUEUE_SIZE];
+    struct capture_shm *shm;
+} CAPTURE;
+
+
+/**
+ * path is where the frames go:
+ *  RAW, Y4M: a file (or named pipe), or "|command" to pipe into a command
+ *  PNG:      a printf pattern for each frame's file, given the frame number
+ *            (e.g. "frame%05u.png")
+ *  SHM:      the name of the shared memory object (e.g. "/gbemu")
+ */
+CAPTURE *Capture_Create(const char *path, CAPTURE_FORMAT format);
+
+// Writes the frames still queued before closing the output
+void Capture_Destroy(CAPTURE *c);
+
+// colors are the 4 shades of the color scheme the frame was drawn with
+void Capture_Frame(CAPTURE *c, PIXEL frame[SCREEN_HEIGHT][SCREEN_WIDTH], const unsigned int colors[4]);
+
+#endif // CAPTURE_H
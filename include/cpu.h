@@ -4,6 +4,9 @@
 #include "common.h"
 #include "memory.h"
 
+// Comment this out to execute common instruction sequences one at a time
+#define CPU_FUSION
+
 static const BYTE Z_FLAG = 0x80; // Zero flag
 static const BYTE N_FLAG = 0x40; // Subtract flag
 static const BYTE H_FLAG = 0x20; // Half-Carry flag
@@ -31,6 +34,8 @@ struct cpu{
     bool halt;
     bool stop;
     bool IME; // Interrupt Master Enable flag
+    bool ei_delay; // EI was just run. IME comes on after the next instruction
+    bool halt_bug; // HALT didn't halt, and the next byte is read twice
     unsigned int cycles;
 
     MEMORY *memory;
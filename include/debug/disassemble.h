@@ -1,12 +1,16 @@
 #ifndef DISASSEMBLE_H
 #define DISASSEMBLE_H
 
-#ifdef DEBUG
+#if defined(DEBUG) || defined(PROFILE)
 
 #include "cpu.h"
 
 const char *Disassemble_Instruction(CPU *c);
 
-#endif // DEBUG
+const char *Disassemble_Opcode(BYTE opcode);
+
+const char *Disassemble_CBOpcode(BYTE opcode);
+
+#endif // DEBUG || PROFILE
 
 #endif // DISASSEMBLE_H
\ No newline at end of file
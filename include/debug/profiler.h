@@ -0,0 +1,54 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#ifdef PROFILE
+
+#include "common.h"
+#include "cpu.h"
+
+/**
+ * Profiling build (make GBemu_Profile)
+ *
+ * Counts executions and cycles for every opcode, every CB prefixed opcode and
+ * every ROM bank / RAM region the PC was in. Results are written as CSV when
+ * the emulator exits, or whenever a dump signal (SIGUSR1, or Ctrl+Break on
+ * Windows) is received. The opcode pair histogram is used to pick the fused
+ * instruction sequences in cpu.c.
+ *
+ * The guest is also sampled every PROFILER_SAMPLE_PERIOD emulated cycles
+ * (override with the GBEMU_SAMPLE_PERIOD environment variable). Each sample
+ * records the call stack built from CALL/RST/interrupt entries and the current
+ * PC, resolved through the game's .sym file when there is one. The samples are
+ * written in folded stack format, ready for flamegraph.pl or speedscope.
+ */
+
+#define PROFILER_OPCODES_FILE "opcode_profile.csv"
+#define PROFILER_BANKS_FILE   "bank_profile.csv"
+#define PROFILER_PAIRS_FILE   "opcode_pairs.csv"
+#define PROFILER_STACKS_FILE  "profile.folded"
+
+#define PROFILER_SAMPLE_PERIOD 4096 // cycles (1024 samples per emulated second)
+
+// Registers the exit and signal handlers that write the profile
+void Profiler_Init();
+
+// Loads RGBDS / no$gmb symbols from the .sym file next to the ROM, if there is one
+void Profiler_LoadSymbols(const char *rom_file);
+
+// Called once per executed instruction, after it has finished
+void Profiler_RecordInstruction(CPU *c, WORD pc, BYTE opcode);
+
+// Cycles spent with the CPU halted
+void Profiler_RecordHalt(CPU *c, unsigned int cycles);
+
+// Called after the CPU has jumped to an interrupt service routine
+void Profiler_RecordInterrupt(CPU *c);
+
+// Called once per frame. Writes the profile if a dump signal was received
+void Profiler_Update();
+
+void Profiler_Dump();
+
+#endif // PROFILE
+
+#endif // PROFILER_H
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include <SDL2/SDL.h>
+#include <stdint.h>
 
 #define SCREEN_WIDTH  160
 #define SCREEN_HEIGHT 144
@@ -29,9 +30,21 @@ typedef struct{
     };
 } PIXEL;
 
+// One bit per line of the screen, line n in bit n % 64 of bits[n / 64]
+typedef struct{
+    uint64_t bits[(SCREEN_HEIGHT + 63) / 64];
+} LINE_MASK;
+
+static inline bool LINE_MASK_TEST(const LINE_MASK *mask, int line) { return (mask->bits[line / 64] >> (line % 64)) & 0x01; }
+
+struct scaler;
+
 typedef struct{
     SDL_Window *window;
     SDL_Renderer *renderer;
+    SDL_Texture *texture;  // Holds the last frame shown, at 1 texel per output pixel
+    struct scaler *scaler; // Upscales frames on the CPU before they're uploaded, if set
+    bool redraw;           // The texture is new, so every line has to be uploaded
 } DISPLAY;
 
 
@@ -39,6 +52,12 @@ DISPLAY *Display_Create();
 
 void Display_Destroy(DISPLAY *d);
 
-void Display_RenderScreen(DISPLAY *d, PIXEL frame[SCREEN_WIDTH][SCREEN_HEIGHT]);
+// Scales frames with s from now on, or uploads them as they are with NULL.
+// The display doesn't take ownership of s
+bool Display_SetScaler(DISPLAY *d, struct scaler *s);
+
+// Shows frame, only uploading the lines that are set in changed. The other
+// lines are expected to be the same as the last time
+void Display_RenderScreen(DISPLAY *d, PIXEL frame[SCREEN_HEIGHT][SCREEN_WIDTH], const LINE_MASK *changed);
 
 #endif // DISPLAY_H
\ No newline at end of file
@@ -0,0 +1,88 @@
+#ifndef FIFO_H
+#define FIFO_H
+
+#include "common.h"
+#include "graphics.h"
+
+#include <stdint.h>
+
+// Dots mode 3 spends before the first pixel comes out. The PPU fetches the
+// first tile twice and throws the first one away
+#define FIFO_START_DELAY 6
+
+// Dots it takes to fetch a tile row: tile number, low byte, high byte
+#define FIFO_FETCH_DOTS 6
+
+// Steps of the background/window fetcher, 2 dots each except FETCH_PUSH,
+// which waits for the background FIFO to run empty
+typedef enum{
+    FETCH_TILE,
+    FETCH_LOW,
+    FETCH_HIGH,
+    FETCH_PUSH
+} FETCH_STEP;
+
+
+/**
+ * A dot by dot model of mode 3. A fetcher reads tile rows into an 8 pixel
+ * background FIFO, and a shifter takes one pixel a dot out of it, mixes it
+ * with the sprite FIFO and sends it to the LCD. Everything is read the dot
+ * it's needed, so registers changed in the middle of a line take effect
+ * where they would on the hardware, and mode 3 comes out as long as it
+ * would: 172 dots, plus SCX % 8 dropped pixels, plus 6 to restart the
+ * fetcher for the window, plus 6 to 11 for every sprite fetched.
+ *
+ * The PPU only runs the FIFO when it's selected (see Graphics_SetEngine).
+ * It's brought up to the current cycle before any write to VRAM, OAM or
+ * the PPU registers, one CPU instruction at a time.
+ */
+typedef struct pixel_fifo{
+    int dots;      // Dots of mode 3 run on this line
+    int x;         // Pixels sent to the LCD on this line
+    int discard;   // Pixels still to drop off the left edge (SCX % 8)
+    BYTE ly;
+    // Background FIFO. It's only refilled when empty, so it never holds more
+    // than one tile row. The next pixel is in bit 7
+    BYTE bg_low;
+    BYTE bg_high;
+    int bg_count;
+    // Sprite FIFO, lined up with the next 8 pixels out. Byte n is pixel n's
+    // color number and attributes
+    uint64_t obj_color;
+    uint64_t obj_attr;
+    // Background/window fetcher
+    FETCH_STEP step;
+    int step_dots;
+    int fetch_x;       // Tile column, relative to SCX / 8 or the window's left edge
+    BYTE tile_id;
+    BYTE tile_low;
+    BYTE tile_high;
+    bool window;       // The fetcher switched to the window on this line
+    bool window_reached; // LY has matched WY this frame
+    BYTE window_line;  // The window's own line counter
+    // Sprites found by the OAM scan, in the order they're fetched
+    BYTE sprites[MAX_LINE_SPRITES];
+    int sprite_count;
+    int next_sprite;
+    bool obj_waiting;  // The shifter reached a sprite, which waits for the fetcher
+    int obj_x;         // Where that sprite starts on screen, as it was when reached
+    int obj_dots;      // Dots into fetching a sprite, 0 when not fetching one
+    BYTE shades[SCREEN_HEIGHT][SCREEN_WIDTH]; // What each pixel came out as, 0-3
+} PIXEL_FIFO;
+
+
+PIXEL_FIFO *Fifo_Create();
+
+void Fifo_Destroy(PIXEL_FIFO *f);
+
+void Fifo_StartFrame(PIXEL_FIFO *f);
+
+// Starts mode 3 of line LY, with the sprites Graphics_ScanOAM found
+void Fifo_StartLine(PIXEL_FIFO *f, const GRAPHICS *g);
+
+// Runs until dots dots into mode 3, or the line is done
+void Fifo_Run(PIXEL_FIFO *f, const GRAPHICS *g, int dots);
+
+static inline bool Fifo_LineDone(const PIXEL_FIFO *f) { return f->x == SCREEN_WIDTH; }
+
+#endif // FIFO_H
@@ -19,6 +19,7 @@ typedef struct{
     DISPLAY *display;
     JOYPAD *joypad;
     APU *apu;
+    unsigned int frame_cycles; // Cycles run so far this frame
 } GAMEBOY;
 
 
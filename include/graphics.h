@@ -14,13 +14,13 @@
 #define MODE_SEARCH_OAM 2
 #define MODE_TRANSFER   3
 
-// Note: These end points are only valid when counting 
-//       down from the clocks per scanline.
-// OAM search mode lasts the first 80 clock cycles, lcd 
-// transfer mode takes the next 172 clock cycles, and 
-// HBLANK (not listed) takes the remining 204 clock cycles.
-#define MODE_SEARCH_END   (CLK_PER_SCANLINE - 80)
-#define MODE_TRANSFER_END (MODE_SEARCH_END - 172)
+// OAM search mode lasts the first 80 clock cycles of a visible
+// scanline, lcd transfer mode takes the next 172 clock cycles,
+// and HBLANK takes the remaining 204 clock cycles. With the pixel FIFO,
+// transfer mode can take longer, and HBLANK is that much shorter.
+#define MODE_SEARCH_CYCLES   80
+#define MODE_TRANSFER_CYCLES 172
+#define MODE_HBLANK_CYCLES   (CLK_PER_SCANLINE - MODE_SEARCH_CYCLES - MODE_TRANSFER_CYCLES)
 
 // LY_ADDR 0xFF44 defined in memory.h
 #define LCDC_ADDR   0xFF40
@@ -34,13 +34,134 @@
 #define WY_ADDR     0xFF4A
 #define WX_ADDR     0xFF4B
 
+// Comment this out to draw frames on the emulation thread
+#define RENDER_THREAD
 
+// Sprites the PPU can draw on one line
+#define MAX_LINE_SPRITES 10
+
+// Most frames in a row that Graphics_SkipNextFrame can skip
+#define MAX_AUTO_SKIP 4
+
+// Indexes into the palette tables, in register order (BGP_ADDR + index)
+#define PALETTE_BG   0
+#define PALETTE_OBJ0 1
+#define PALETTE_OBJ1 2
+
+// Ways of drawing frames. See Graphics_SetEngine
+typedef enum{
+    ENGINE_SCANLINE, // Whole lines, from registers latched at the end of mode 3
+    ENGINE_FIFO,     // A dot at a time, through the pixel FIFO
+    ENGINE_COMPARE,  // Both, reporting where they differ. Shows the scanline frames
+    ENGINE_COUNT
+} GRAPHICS_ENGINE;
+
+// Sets of 4 shades the DMG palettes map onto
+typedef enum{
+    SCHEME_GRAY,
+    SCHEME_DMG,     // Green tinted original LCD
+    SCHEME_POCKET,
+    SCHEME_LIGHT,
+    SCHEME_COUNT
+} COLOR_SCHEME;
+
+
+/**
+ * What the renderer needs to know about one line. The registers are copied
+ * when the line is on screen, so the line can be drawn later on and still
+ * look the way it would have if it was drawn right then.
+ */
 typedef struct{
-    int scanline_counter;
-    PIXEL frame_buffer[SCREEN_WIDTH][SCREEN_HEIGHT];
+    BYTE lcdc;
+    BYTE scx;
+    BYTE scy;
+    BYTE wx;
+    bool window;                    // Whether the window is drawn on this line
+    BYTE window_line;               // Which line of the window that is
+    BYTE palette_data[3];           // BGP, OBP0, OBP1
+    BYTE sprite_count;
+    BYTE sprites[MAX_LINE_SPRITES]; // OAM indexes, highest priority first
+} LINE_STATE;
+
+/**
+ * Everything the renderer reads to draw a frame. The PPU fills in its own
+ * as the frame goes by, pointing at the live VRAM and OAM. With
+ * RENDER_THREAD, a copy with its own VRAM and OAM goes to the render thread.
+ */
+typedef struct{
+    LINE_STATE lines[SCREEN_HEIGHT];
+    COLOR_SCHEME scheme;
+    const BYTE *vram;
+    const BYTE *oam;
+    PIXEL (*pixels)[SCREEN_WIDTH]; // Where the lines get drawn
+    uint64_t *line_hash;           // Where a hash of each drawn line goes
+} FRAME;
+
+struct render_thread;
+struct capture;
+struct pixel_fifo;
+
+typedef struct graphics GRAPHICS;
+
+/**
+ * The PPU only does work when it reaches the end of the current mode.
+ * event_cycles counts down to that point, and Graphics_Update just subtracts
+ * from it until it runs out. LCDC, STAT, LY, LYC, BGP, OBP0 and OBP1 belong to
+ * the PPU; the memory map forwards reads and writes of those registers here.
+ *
+ * Lines aren't drawn as the PPU reaches them. Each visible line's registers
+ * are latched into lines[] and the whole frame is drawn at VBLANK. A write
+ * to VRAM or OAM in the middle of a frame first draws the lines latched so
+ * far, since they have to see VRAM and OAM as they were.
+ *
+ * With RENDER_THREAD, the lines still to be drawn at VBLANK are handed to
+ * the render thread along with a copy of VRAM and OAM, and the emulation
+ * thread carries on. Presentation stays on the thread that owns the SDL
+ * renderer and just shows the newest frame the render thread finished.
+ *
+ * Every drawn line is hashed. Before a frame is shown, its hashes are
+ * compared with the last shown frame's, and only the lines that changed are
+ * passed on to the display. A frame where nothing changed isn't shown at all.
+ *
+ * With the pixel FIFO engine, mode 3 is run a dot at a time instead, and
+ * ends whenever the FIFO is done with the line. Frames are drawn as the
+ * FIFO goes, on the emulation thread.
+ */
+struct graphics{
+    PIXEL frame_buffer[SCREEN_HEIGHT][SCREEN_WIDTH]; // First, so rows are as aligned as malloc's memory
+    int event_cycles; // cycles left until the next mode change
+    BYTE mode;
+    BYTE lcdc;
+    BYTE stat;        // Only the interrupt select bits (3-6) are stored
+    BYTE ly;
+    BYTE lyc;
+    bool stat_line;   // STAT interrupts are requested on the rising edge of this
+    BYTE palette_data[3];          // BGP, OBP0, OBP1
+    COLOR_SCHEME scheme;
+    FRAME frame;
+    uint64_t line_hash[SCREEN_HEIGHT];  // Of the lines in frame_buffer
+    uint64_t shown_hash[SCREEN_HEIGHT]; // Of the lines last shown
+    LINE_MASK changed_lines;            // Lines of the last frame that differ from the one before
+    bool window_reached; // LY has matched WY this frame
+    BYTE window_line;    // The window's own line counter
+    int lines_latched;  // Lines of the current frame latched so far
+    int lines_drawn;    // Lines of the current frame drawn so far
+    int frame_skip;     // Frames skipped after every drawn frame
+    int skipped_frames; // Frames skipped in a row so far
+    bool skip_next;     // Set by Graphics_SkipNextFrame
+    bool skip_frame;    // The current frame isn't being drawn
+    bool frame_ready;   // A drawn frame finished and hasn't been shown yet
+    GRAPHICS_ENGINE engine;      // Drawing the current frame
+    GRAPHICS_ENGINE next_engine; // Takes over at the start of the next frame
+    struct pixel_fifo *fifo;     // Created the first time it's selected
+    int transfer_cycles;         // How long mode 3 is on this line, as far as we know yet
+    unsigned int compared_frames;   // Frames ENGINE_COMPARE checked
+    unsigned int mismatched_frames; // Of those, the ones that differed
+    struct render_thread *render_thread; // NULL when frames are drawn inline
+    struct capture *capture;             // Gets every frame, if set
     MEMORY *memory;
     DISPLAY *display;
-} GRAPHICS;
+};
 
 
 GRAPHICS *Graphics_Create();
@@ -51,18 +172,90 @@ void Graphics_SetMemory(GRAPHICS *g, MEMORY *mem);
 
 void Graphics_SetDisplay(GRAPHICS *g, DISPLAY *d);
 
+void Graphics_Startup(GRAPHICS *g);
+
 void Graphics_Update(GRAPHICS *g, int cycles);
 
+// Shows the last drawn frame, if it hasn't been shown already and differs
+// from the one that was
 void Graphics_RenderScreen(GRAPHICS *g);
 
+/**
+ * Whether the last frame Graphics_RenderScreen got differed from the one
+ * before it. changed_lines says which lines did, for anything that wants to
+ * skip work on the rest.
+ */
+bool Graphics_FrameChanged(GRAPHICS *g);
+
+// Hands every frame from now on to c as well, or stops with NULL. While
+// there's a capture no frames are skipped, and with RENDER_THREAD they're
+// drawn on the emulation thread, so c gets all of them
+void Graphics_SetCapture(GRAPHICS *g, struct capture *c);
+
+// Makes the next frame count as changed on every line, e.g. after the
+// display lost what it was showing
+void Graphics_InvalidateScreen(GRAPHICS *g);
+
+/**
+ * Skipped frames aren't drawn at all, but LY, STAT and the interrupts keep
+ * exact timing. With frames > 0, only 1 out of every frames + 1 is drawn.
+ */
+void Graphics_SetFrameSkip(GRAPHICS *g, int frames);
+
+// Skips the next frame, unless MAX_AUTO_SKIP frames were already skipped
+void Graphics_SkipNextFrame(GRAPHICS *g);
+
 bool Graphics_LCDEnabled(GRAPHICS *g);
 
-void Graphics_UpdateLCDSTAT(GRAPHICS *g);
+/**
+ * Switches to another way of drawing frames, from the next frame on. The
+ * pixel FIFO is only created, and only costs anything, once it's selected.
+ * Returns false if it couldn't be created.
+ *
+ * ENGINE_COMPARE runs the scanline renderer off the pixel FIFO's timing and
+ * prints every frame where the two differ, to validate the fast path
+ * against the accurate one.
+ */
+bool Graphics_SetEngine(GRAPHICS *g, GRAPHICS_ENGINE engine);
+
+const char *Graphics_EngineName(GRAPHICS_ENGINE engine);
+
+// Changes the set of shades frames are drawn with
+void Graphics_SetColorScheme(GRAPHICS *g, COLOR_SCHEME scheme);
+
+// Handles LCDC, STAT, LY, LYC, BGP, OBP0 and OBP1
+BYTE Graphics_ReadRegister(GRAPHICS *g, WORD addr);
+
+void Graphics_WriteRegister(GRAPHICS *g, WORD addr, BYTE data);
+
+/**
+ * Finds the first MAX_LINE_SPRITES sprites in OAM that are on line LY and
+ * sorts them by priority: lower X first, then lower OAM index. Runs at the
+ * end of OAM search mode.
+ */
+void Graphics_ScanOAM(GRAPHICS *g);
+
+// Draws every line that was latched but not drawn yet, and brings the pixel
+// FIFO up to now. Called before VRAM or OAM changes
+void Graphics_FlushLines(GRAPHICS *g);
+
+// Brings the pixel FIFO up to now, if it's running. Called before a
+// register it reads changes
+void Graphics_CatchUp(GRAPHICS *g);
 
-void Graphics_DrawScanline(GRAPHICS *g);
+/**
+ * Renders a latched line of a frame, and stores its hash. The renderer works on whole tile rows
+ * and uses SSE2, SSSE3, AVX2 or BMI2 when the compiler targets them
+ * (e.g. -march=native), with plain C otherwise.
+ */
+void Graphics_DrawScanline(const FRAME *f, int ly);
 
-void Graphics_RenderTiles(GRAPHICS *g, BYTE lcdc);
+// Draws the background and window of line ly into line[0..159], and their
+// color numbers into bg_index[0..159]. The background is drawn left of the
+// window, and the window from WX - 7 to the end of the line
+void Graphics_RenderTiles(const FRAME *f, int ly, PIXEL *line, BYTE *bg_index);
 
-void Graphics_RenderSprites(GRAPHICS *g, BYTE lcdc);
+// Draws the sprites found by Graphics_ScanOAM over line[0..159]
+void Graphics_RenderSprites(const FRAME *f, int ly, PIXEL *line, const BYTE *bg_index);
 
 #endif // GRAPHICS_H
\ No newline at end of file
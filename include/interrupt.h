@@ -7,10 +7,20 @@
 static const WORD VBLANK_ROUTINE    = 0x40;
 static const WORD LCD_STAT_ROUTINE  = 0x48;
 static const WORD TIMER_ROUTINE     = 0x50;
+static const WORD SERIAL_ROUTINE    = 0x58;
 static const WORD JOYPAD_ROUTINE    = 0x60;
 
 
-void Interrupt_Handle(CPU *c);
+// Wakes the CPU from HALT, services the highest priority interrupt, and
+// starts IME after EI. Only Interrupt_Handle needs to call it
+void Interrupt_Service(CPU *c);
+
+// Runs after every instruction. Almost always nothing is pending and EI
+// wasn't just run, which only takes one test of two values already at hand
+static inline void Interrupt_Handle(CPU *c){
+    if((c->memory->pending | c->ei_delay) != 0)
+        Interrupt_Service(c);
+}
 
 
 #endif // INTERRUPT_H
\ No newline at end of file
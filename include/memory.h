@@ -56,6 +56,11 @@ typedef enum{
     IE      = 0xFFFF
 } MEM_REGION;
 
+// Components that own some of the IO registers
+struct timer;
+struct graphics;
+struct apu;
+
 // 64 KB Byte-Addressable Memory
 typedef struct{
     CARTRIDGE *cartridge; // Contains the entire game rom and keeps track of:
@@ -64,7 +69,12 @@ typedef struct{
                           //  8 KB: Switchable RAM bank
     BYTE vram[0x2000];    //  8 KB: VRAM
     BYTE mem[0x4000];     // 16 KB: Remaining memory
+    BYTE pending;         // IE & IF: interrupts both requested and enabled.
+                          // Kept up to date on every change to either
     JOYPAD *joypad;
+    struct timer *timer;
+    struct graphics *graphics;
+    struct apu *apu;
 } MEMORY;
 
 MEMORY *Mem_Create();
@@ -79,6 +89,12 @@ void Mem_Destroy(MEMORY *mem);
 
 void Mem_SetJoypad(MEMORY *mem, JOYPAD *j);
 
+void Mem_SetTimer(MEMORY *mem, struct timer *t);
+
+void Mem_SetGraphics(MEMORY *mem, struct graphics *g);
+
+void Mem_SetAPU(MEMORY *mem, struct apu *a);
+
 void Mem_WriteByte(MEMORY *mem, WORD addr, BYTE data);
 
 void Mem_WriteWord(MEMORY *mem, WORD addr, WORD data);
@@ -0,0 +1,57 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include "common.h"
+#include "blip.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Records one sample per machine cycle, the rate the APU's output can
+// actually change at
+#define RECORD_NATIVE_RATE CYCLE_F
+
+// Highest resampled rate. A frame's worth has to fit in a blip buffer
+#define RECORD_MAX_RATE 192000
+
+typedef enum{
+    RECORD_RAW, // 16 bit little endian stereo PCM, left first, no header
+    RECORD_WAV  // The same, in a WAV file
+} RECORD_FORMAT;
+
+/**
+ * Writes the APU's output to a file, with or without an audio device. The
+ * APU tells it the mixed level of each side every time it changes, at the
+ * cycle it changed, and it writes out each frame when the frame ends.
+ * Nothing depends on the audio device or the time it's run at, so the
+ * same game and input always record the same file.
+ *
+ * At RECORD_NATIVE_RATE the levels are written as they are, a sample per
+ * machine cycle. They're never negative, like the DMG's DACs' output
+ * before the capacitors that center it. At any other rate they're
+ * resampled through a blip buffer, which also takes the DC out.
+ */
+typedef struct recorder{
+    RECORD_FORMAT format;
+    FILE *file;
+    int rate;
+    BLIP_BUFFER *blip;    // Not used at RECORD_NATIVE_RATE
+    int level[2];         // The last levels the APU sent, {left, right}
+    unsigned int time;    // Native: cycle of this frame the next sample is at
+    unsigned long long samples; // Written so far
+} RECORDER;
+
+
+// rate is RECORD_NATIVE_RATE or up to RECORD_MAX_RATE samples per second
+RECORDER *Recorder_Create(const char *path, RECORD_FORMAT format, int rate);
+
+// Finishes the file
+void Recorder_Destroy(RECORDER *r);
+
+// The levels changed to level at time cycles into the frame
+void Recorder_Change(RECORDER *r, unsigned int time, const int level[2]);
+
+// Writes the frame out. It ends at time, which becomes time 0 of the next one
+void Recorder_EndFrame(RECORDER *r, unsigned int time);
+
+#endif // RECORDER_H
@@ -0,0 +1,64 @@
+#ifndef SCALER_H
+#define SCALER_H
+
+#include "common.h"
+#include "display.h"
+
+// Largest factor SCALER_NEAREST goes up to
+#define MAX_SCALE 4
+
+// Pixels of the frame each scaler looks at on every side of the one it scales
+#define SCALER_BORDER 2
+
+typedef enum{
+    SCALER_NEAREST, // Every pixel becomes a scale x scale block
+    SCALER_SCALE2X, // AdvMAME2x, rounds off diagonal edges
+    SCALER_SCALE3X, // AdvMAME3x
+    SCALER_HQ2X,    // Blends corners where the colors form an edge
+    SCALER_XBR2X,   // Blends corners along edges found over a 5x5 area
+    SCALER_COUNT
+} SCALER_TYPE;
+
+
+/**
+ * Upscales frames on the CPU, for outputs that don't have a GPU to do it.
+ * Only the lines that changed since the last frame are scaled again, along
+ * with the lines around them that look at them.
+ *
+ * Nearest, Scale2x and Scale3x use SSE2 or AVX2 when the compiler targets
+ * them (e.g. -march=native). HQ2x and xBR pick a blend for each corner of
+ * each pixel from how its neighbours compare, which doesn't map onto vectors
+ * well, so they're plain C. With reference set, the plain C versions are
+ * used for everything.
+ */
+typedef struct scaler{
+    SCALER_TYPE type;
+    int scale;      // Output pixels per frame pixel, in each direction
+    int width;      // Of the output, in pixels
+    int height;
+    bool reference;
+    PIXEL *pixels;  // The output, width * height pixels
+    // The frame, with its edge pixels repeated SCALER_BORDER times around it
+    PIXEL input[SCREEN_HEIGHT + 2 * SCALER_BORDER][SCREEN_WIDTH + 2 * SCALER_BORDER];
+} SCALER;
+
+
+// scale is only used by SCALER_NEAREST. The others have a fixed one
+SCALER *Scaler_Create(SCALER_TYPE type, int scale);
+
+void Scaler_Destroy(SCALER *s);
+
+const char *Scaler_Name(SCALER_TYPE type);
+
+/**
+ * Scales the lines of frame set in changed. scaled gets every line whose
+ * output was written (changed and its neighbours), so s->pixels rows
+ * line * scale to (line + 1) * scale - 1 are new for each line set in it.
+ * scaled may be NULL.
+ */
+void Scaler_Scale(SCALER *s, PIXEL frame[SCREEN_HEIGHT][SCREEN_WIDTH], const LINE_MASK *changed, LINE_MASK *scaled);
+
+// Times every scaler, and its plain C version, on frame and prints the results
+void Scaler_Benchmark(PIXEL frame[SCREEN_HEIGHT][SCREEN_WIDTH], int runs);
+
+#endif // SCALER_H
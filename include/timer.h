@@ -4,18 +4,35 @@
 #include "common.h"
 #include "memory.h"
 
-typedef struct{
-    int timer_counter;
-    union{
-        struct{
-            BYTE __unused;
-            BYTE div;
-        };
-        WORD system_counter;
-    };
+#include <limits.h>
+
+// When TIMA won't overflow: the timer is stopped
+#define TIMER_NEVER UINT_MAX
+
+/**
+ * DIV is the top 8 bits of a 16 bit system counter that goes up every
+ * cycle. TIMA goes up on each falling edge of one of the counter's bits,
+ * chosen by TAC, ANDed with TAC's enable bit. So anything that clears
+ * that signal while it's high ticks TIMA too: a write to DIV, turning the
+ * timer off, or selecting a bit that's low.
+ *
+ * The timer holds DIV, TIMA, TMA and TAC itself, and memory asks it for
+ * them. Like the APU, it doesn't run alongside the CPU. It's behind until
+ * one of its registers is read or written, then it catches up to the
+ * clock all at once: the number of falling edges in between is just how
+ * many times the counter passed a multiple of twice the selected bit.
+ * The only thing that can't wait is the interrupt when TIMA overflows, so
+ * the timer works out the cycle that'll happen at ahead of time, and it
+ * only needs to be run once the clock gets there.
+ */
+typedef struct timer{
+    WORD system_counter;   // At time. DIV is bits 8-15
     BYTE tima;
     BYTE tma;
-    BYTE tac;
+    BYTE tac;              // Bits 0-2
+    const unsigned int *clock; // Cycles run so far this frame
+    unsigned int time;     // Cycles of this frame the timer has run
+    unsigned int overflow; // Cycle of this frame TIMA overflows next, or TIMER_NEVER
 
     MEMORY *memory;
 } TIMER;
@@ -26,8 +43,22 @@ void Timer_SetMemory(TIMER *t, MEMORY *mem);
 
 void Timer_Destroy(TIMER *t);
 
-void Timer_Update(TIMER *t, unsigned int cycles);
+// Takes the timer registers' values after the boot ROM from memory
+void Timer_Startup(TIMER *t);
+
+// The timer runs up to *clock whenever it catches up
+void Timer_SetClock(TIMER *t, const unsigned int *clock);
+
+// Runs up to the clock, requesting the interrupt if TIMA overflowed.
+// Only has to be called once the clock reaches t->overflow
+void Timer_CatchUp(TIMER *t);
+
+// Catches up. The clock starts over from 0 after this
+void Timer_EndFrame(TIMER *t);
+
+// Catches up, then reads or writes DIV, TIMA, TMA or TAC
+BYTE Timer_ReadRegister(TIMER *t, WORD addr);
 
-void Timer_ResetCounter(TIMER *t);
+void Timer_WriteRegister(TIMER *t, WORD addr, BYTE data);
 
-#endif // TIMER_H
\ No newline at end of file
+#endif // TIMER_H
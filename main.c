@@ -1,12 +1,30 @@
 #include "gameboy.h"
+#include "capture.h"
+#include "recorder.h"
+#include "scaler.h"
 #include <SDL2/SDL.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #ifdef DEBUG
 #include "gbdebug.h"
 #endif // DEBUG
 
+#ifdef PROFILE
+#include "profiler.h"
+#endif // PROFILE
+
+// Frames skipped after every drawn frame
+#define FRAME_SKIP 0
+
+// Comment this out to draw every frame even when emulation falls behind
+#define AUTO_FRAME_SKIP
+
+// Give up catching up once this far behind, instead of running flat out
+#define MAX_LAG_MS 250
+
 
 int SDL_main(int argc, char *argv[]){
     SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
@@ -19,16 +37,68 @@ int SDL_main(int argc, char *argv[]){
             break;
         }
     }
+#ifdef PROFILE
+    Profiler_Init();
+#endif // PROFILE
     GAMEBOY *gb = GB_Create();
-    if(gb->apu == NULL)
-        puts("Unable to create APU. No sound will be played.");
     GB_LoadGame(gb, game_file);
+#ifdef PROFILE
+    Profiler_LoadSymbols(game_file);
+#endif // PROFILE
     GB_Startup(gb);
+    // Records every frame to GBEMU_CAPTURE, as GBEMU_CAPTURE_FORMAT
+    // (raw, y4m, png or shm; y4m by default)
+    CAPTURE *capture = NULL;
+    if(getenv("GBEMU_CAPTURE") != NULL){
+        const char *formats[] = {"raw", "y4m", "png", "shm"};
+        CAPTURE_FORMAT format = CAPTURE_Y4M;
+        const char *name = getenv("GBEMU_CAPTURE_FORMAT");
+        for(int i = 0; name != NULL && i < 4; i++){
+            if(strcmp(name, formats[i]) == 0)
+                format = i;
+        }
+        capture = Capture_Create(getenv("GBEMU_CAPTURE"), format);
+        Graphics_SetCapture(gb->graphics, capture);
+    }
+    // Records the sound to GBEMU_AUDIO_CAPTURE, as GBEMU_AUDIO_CAPTURE_FORMAT
+    // (raw or wav; wav by default), at GBEMU_AUDIO_CAPTURE_RATE samples per
+    // second or "native" (44100 by default). Recording doesn't open the
+    // audio device, so the file only depends on the game and the input
+    RECORDER *recorder = NULL;
+    if(getenv("GBEMU_AUDIO_CAPTURE") != NULL){
+        const char *name = getenv("GBEMU_AUDIO_CAPTURE_FORMAT");
+        RECORD_FORMAT format = (name != NULL && strcmp(name, "raw") == 0) ? RECORD_RAW : RECORD_WAV;
+        const char *rate = getenv("GBEMU_AUDIO_CAPTURE_RATE");
+        int samples = 44100;
+        if(rate != NULL)
+            samples = (strcmp(rate, "native") == 0) ? RECORD_NATIVE_RATE : atoi(rate);
+        recorder = Recorder_Create(getenv("GBEMU_AUDIO_CAPTURE"), format, samples);
+        APU_SetRecorder(gb->apu, recorder);
+    }
+    // GBEMU_AUDIO=off runs without sound, and the APU then does only what
+    // the game can see
+    else if(getenv("GBEMU_AUDIO") == NULL || strcmp(getenv("GBEMU_AUDIO"), "off") != 0){
+        if(!APU_OpenDevice(gb->apu))
+            puts("Unable to open the audio device. No sound will be played.");
+    }
+    // Draws frames with GBEMU_PPU (scanline, fifo or compare)
+    if(getenv("GBEMU_PPU") != NULL){
+        const char *engines[] = {"scanline", "fifo", "compare"};
+        for(int i = 0; i < ENGINE_COUNT; i++){
+            if(strcmp(getenv("GBEMU_PPU"), engines[i]) == 0 && !Graphics_SetEngine(gb->graphics, i))
+                printf("Unable to use the %s PPU.\n", Graphics_EngineName(i));
+        }
+    }
 #ifdef DEBUG
     Start_Debugger(gb);
 #else
     SDL_Event event;
     bool running = true;
+    SCALER *scaler = NULL;
+    int scaler_type = SCALER_COUNT; // SCALER_COUNT means no scaler
+    Uint32 start = SDL_GetTicks();
+    Uint64 updates = 0;
+    Graphics_SetFrameSkip(gb->graphics, FRAME_SKIP);
     while(running){
         if(SDL_PollEvent(&event)){
             switch(event.type){
@@ -36,7 +106,46 @@ int SDL_main(int argc, char *argv[]){
                     running = false;
                     break;
                 case SDL_KEYDOWN:
-                    if(Joypad_SetState(gb->joypad, event, JOYPAD_PRESSED, Mem_ReadByte(gb->memory, P1_ADDR))){
+                    if(event.key.keysym.scancode == SDL_SCANCODE_P){
+                        // Cycle through the color schemes
+                        Graphics_SetColorScheme(gb->graphics, (gb->graphics->scheme + 1) % SCHEME_COUNT);
+                    }
+                    else if(event.key.keysym.scancode == SDL_SCANCODE_O){
+                        // Cycle through the scalers, then back to none
+                        scaler_type = (scaler_type + 1) % (SCALER_COUNT + 1);
+                        Display_SetScaler(gb->display, NULL);
+                        Scaler_Destroy(scaler);
+                        scaler = NULL;
+                        if(scaler_type < SCALER_COUNT){
+                            scaler = Scaler_Create(scaler_type, PIXEL_SIZE);
+                            if(scaler != NULL && Display_SetScaler(gb->display, scaler)){
+                                printf("Scaler: %s\n", Scaler_Name(scaler_type));
+                            }
+                            else{
+                                printf("Unable to use the %s scaler.\n", Scaler_Name(scaler_type));
+                                Display_SetScaler(gb->display, NULL);
+                                Scaler_Destroy(scaler);
+                                scaler = NULL;
+                            }
+                        }
+                        Graphics_InvalidateScreen(gb->graphics);
+                    }
+                    else if(event.key.keysym.scancode == SDL_SCANCODE_F){
+                        // Cycle through the ways of drawing frames
+                        GRAPHICS_ENGINE engine = (gb->graphics->next_engine + 1) % ENGINE_COUNT;
+                        if(Graphics_SetEngine(gb->graphics, engine)){
+                            printf("PPU: %s\n", Graphics_EngineName(engine));
+                        }
+                        else{
+                            printf("Unable to use the %s PPU.\n", Graphics_EngineName(engine));
+                        }
+                    }
+#ifdef PROFILE
+                    else if(event.key.keysym.scancode == SDL_SCANCODE_I){
+                        Scaler_Benchmark(gb->graphics->frame_buffer, 100);
+                    }
+#endif // PROFILE
+                    else if(Joypad_SetState(gb->joypad, event, JOYPAD_PRESSED, Mem_ReadByte(gb->memory, P1_ADDR))){
                         // If there's a joypad interrupt
                         Mem_RequestInterrupt(gb->memory, IF_JOYPAD);
                     }
@@ -47,9 +156,31 @@ int SDL_main(int argc, char *argv[]){
             };
         }
         GB_Update(gb);
-        SDL_Delay(30);
+
+        // Each update is 1/UPDATES_PER_SEC of a second of emulation
+        updates++;
+        Uint32 deadline = start + (Uint32) (updates * 1000 / UPDATES_PER_SEC);
+        Uint32 now = SDL_GetTicks();
+        if((Sint32) (deadline - now) > 0){
+            SDL_Delay(deadline - now);
+        }
+        else if(now - deadline > MAX_LAG_MS){
+            start = now;
+            updates = 0;
+        }
+#ifdef AUTO_FRAME_SKIP
+        else{
+            // Behind schedule. Don't spend time drawing the next frame
+            Graphics_SkipNextFrame(gb->graphics);
+        }
+#endif // AUTO_FRAME_SKIP
     }
+    Scaler_Destroy(scaler);
 #endif // DEBUG
+    Graphics_SetCapture(gb->graphics, NULL);
+    Capture_Destroy(capture);
+    APU_SetRecorder(gb->apu, NULL);
+    Recorder_Destroy(recorder);
     GB_Destroy(gb);
     SDL_Quit();
     return 0;
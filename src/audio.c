@@ -1,232 +1,884 @@
 #include "audio.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include <time.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define SAMPLE_FREQUENCY     44100 // Hz
 #define FRAME_SEQUENCER_FREQ   512 // Hz
 
-// Volume needs to be normalized to [-1.0, 1.0] when using F32 audio format
-#define MAX_VOLUME 3000
-#define MAX_OUTPUT_VOLUME (MAX_VOLUME / 6)
-#define MAX_CHANNEL_VOLUME (MAX_OUTPUT_VOLUME / 4)
+// Level of one step of a channel's output (0-15) at full master volume. A
+// side sums 4 channels at up to 8 times this, which leaves some headroom
+// in 16 bits for the ringing of band-limited steps
+#define VOLUME_UNIT 48
 
-#define ADJUST_VOLUME(sample, factor) ((sample) *= ((MAX_OUTPUT_VOLUME * (factor)) / 7))
+const int CYCLES_PER_FRAME  = CLK_F / FRAME_SEQUENCER_FREQ;
 
-#define NORMALIZE_SAMPLE(sample) ((sample) /= MAX_VOLUME)
+#define REG(a, addr) ((a)->regs[(addr) - NR10_ADDR])
 
-const int CYCLES_PER_SAMPLE = CLK_F / SAMPLE_FREQUENCY;
-const int CYCLES_PER_FRAME  = CLK_F / FRAME_SEQUENCER_FREQ;
+// Register x (0-4) of channel n (0-3), e.g. NRX(a, 1, 2) is NR22. The
+// channels' registers are 5 apart, starting at NR10
+#define NRX(a, n, x) ((a)->regs[(n) * 5 + (x)])
 
-static const AudioSample square_wave_table[4][8] =
-{   // Same type as the audio data buffer and audio spec format
+// Sequences of the noise channel's LFSR, in 15 and 7 bit mode
+#define LFSR15_LENGTH 0x7FFF
+#define LFSR7_LENGTH  0x7F
+#define LFSR_LOCKED   0xFFFF // An LFSR of all zeros never changes
+
+static const int square_wave_table[4][8] =
+{
     {1, 0, 0, 0, 0, 0, 0, 0}, // 12.5% duty
     {1, 1, 0, 0, 0, 0, 0, 0}, // 25% duty
     {1, 1, 1, 1, 0, 0, 0, 0}, // 50% duty
     {1, 1, 1, 1, 1, 1, 0, 0}  // 75% duty
 };
 
-static inline int us_to_cycles(float us) { return (int) round(us * CLK_F); }
+// Bits that read back as 1 in each sound register, whatever was written.
+// Frequencies and lengths can't be read at all. NR52's low bits are the
+// channels' status, filled in when it's read
+static const BYTE read_masks[APU_REGISTERS] =
+{
+    0x80, 0x3F, 0x00, 0xFF, 0xBF, // NR10-NR14
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF, // FF15, NR21-NR24
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF, // NR30-NR34
+    0xFF, 0xFF, 0x00, 0x00, 0xBF, // FF1F, NR41-NR44
+    0x00, 0x00, 0x70,             // NR50-NR52
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, // FF27-FF2F
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,       // Wave RAM
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+// How far the wave channel's samples are shifted down, for each NR32 volume
+static const int wave_volume_shift[4] = {4, 0, 1, 2};
+
+// The noise channel's base period for each NR43 divisor code, in cycles
+static const int noise_divisor[8] = {8, 16, 32, 48, 64, 80, 96, 112};
+
+/**
+ * Each LFSR width has a single sequence of states, so instead of clocking
+ * it a bit at a time, the noise channel works with where it is in that
+ * sequence. runs holds how many clocks it takes for bit 0 (the output) to
+ * change, so the channel jumps from one change of its output to the next,
+ * and a silent channel just adds its clocks to its position.
+ */
+typedef struct{
+    int length;
+    WORD mask;           // Bits of the LFSR the sequence goes through
+    WORD *states;        // [length] The state at each position
+    WORD *position;      // [mask + 1] The position of each state
+    BYTE *runs;          // [length] Clocks until the output changes
+} LFSR_TABLE;
+
+static WORD lfsr15_states[LFSR15_LENGTH];
+static WORD lfsr15_position[LFSR15_LENGTH + 1];
+static BYTE lfsr15_runs[LFSR15_LENGTH];
+static WORD lfsr7_states[LFSR7_LENGTH];
+static WORD lfsr7_position[LFSR7_LENGTH + 1];
+static BYTE lfsr7_runs[LFSR7_LENGTH];
+
+static LFSR_TABLE lfsr_tables[2] =
+{
+    {LFSR15_LENGTH, 0x7FFF, lfsr15_states, lfsr15_position, lfsr15_runs}, // NR43 bit 3 clear
+    {LFSR7_LENGTH,  0x7F,   lfsr7_states,  lfsr7_position,  lfsr7_runs}   // NR43 bit 3 set
+};
+static bool lfsr_tables_ready = false;
 
 static void Update_Ch1(APU *a, int cycles); // Square wave with sweep and envelope
 static void Update_Ch2(APU *a, int cycles); // Square wave with envelope
 static void Update_Ch3(APU *a, int cycles); // Arbitrary waveform
 static void Update_Ch4(APU *a, int cycles); // White noise
+static void UpdateTone(APU *a, int n, int steps, int cycles);
+static int SkipSteps(CHANNEL *ch, int cycles);
+static void WriteChannel(APU *a, int n, int x);
+static void SetPeriod(APU *a, int n);
+static void Trigger(APU *a, int n);
+static void Disable(APU *a, int n);
+static void PowerOff(APU *a);
+static void StepSequencer(APU *a);
+static void ClockEnvelope(APU *a, int n);
+static void SkipEnvelope(APU *a, int n, int clocks);
+static int SweepFrequency(APU *a);
+static void ClockSweep(APU *a);
+static void InitLfsrTable(LFSR_TABLE *t, int width);
+static WORD LfsrState(bool narrow, int position);
+static void CatchUp(APU *a);
+static void CatchUpSilent(APU *a, int cycles);
+static int CountSteps(int first, int steps, BYTE mask);
+static bool Silent(APU *a);
+static void Refresh(APU *a);
+static int Level(APU *a, int n);
+static void SetOutput(APU *a, int n, unsigned int time);
+static void Mix(APU *a, unsigned int time);
+static void PushSamples(APU *a, int16_t samples[][2], int count);
+static void ConvertSamples(AudioSample out[][2], int16_t samples[][2], int count);
+#ifdef DYNAMIC_RATE_CONTROL
+static void AdjustRate(APU *a);
+#endif // DYNAMIC_RATE_CONTROL
+static void AudioCallback(void *data, Uint8 *stream, int len);
 
 APU *APU_Create(){
     APU *apu = malloc(sizeof(APU));
     if(apu != NULL){
         memset(apu, 0, sizeof(APU));
-        SDL_AudioSpec want;
-#ifdef FLOAT32_AUDIO
-        want.format = AUDIO_F32SYS;
-#else
-        want.format = AUDIO_S16SYS;
-#endif // FLOAT32_AUDIO
-        want.freq = SAMPLE_FREQUENCY;
-        want.channels = 2; // Stereo Sound
-        want.samples = AUDIO_BUFFER_LENGTH;
-        want.callback = NULL;
-        SDL_OpenAudio(&want, &apu->audio_spec);
-        if(apu->audio_spec.freq != want.freq || apu->audio_spec.format != want.format){
+        APU_SetLatency(apu, AUDIO_LATENCY_MS);
+        apu->sequencer_timer = CYCLES_PER_FRAME;
+        REG(apu, NR52_ADDR) = 0x80;
+        if(!lfsr_tables_ready){
+            InitLfsrTable(&lfsr_tables[0], 15);
+            InitLfsrTable(&lfsr_tables[1], 7);
+            lfsr_tables_ready = true;
+        }
+        if((apu->blip = Blip_Create()) == NULL){
             APU_Destroy(apu);
             apu = NULL;
         }
         else{
-            apu->sample_timer = CYCLES_PER_SAMPLE;
-            apu->sequence[0] = apu->sequence[1] = 0;
-            srand(time(NULL)); // Random number needed for noise on channel 4
-            SDL_PauseAudio(0);
+            Blip_SetRates(apu->blip, CLK_F, SAMPLE_FREQUENCY);
         }
     }
     return apu;
 }
 
+bool APU_OpenDevice(APU *a){
+    if(a == NULL)
+        return false;
+    if(a->device != 0)
+        return true;
+    // Whatever the channels are putting out while nothing was listening
+    Refresh(a);
+    SDL_AudioSpec want;
+#ifdef FLOAT32_AUDIO
+    want.format = AUDIO_F32SYS;
+#else
+    want.format = AUDIO_S16SYS;
+#endif // FLOAT32_AUDIO
+    want.freq = SAMPLE_FREQUENCY;
+    want.channels = 2; // Stereo Sound
+    want.samples = AUDIO_DEVICE_SAMPLES;
+    want.callback = AudioCallback;
+    want.userdata = a;
+    a->device = SDL_OpenAudioDevice(NULL, 0, &want, &a->audio_spec, 0);
+    if(a->device != 0 && (a->audio_spec.freq != want.freq || a->audio_spec.format != want.format)){
+        SDL_CloseAudioDevice(a->device);
+        a->device = 0;
+    }
+    if(a->device == 0)
+        return false;
+    // The blip buffer only gets changes while there's a device, so it
+    // starts from whatever's playing now
+    Blip_AddDelta(a->blip, a->time, a->mixed[0], a->mixed[1]);
+    SDL_PauseAudioDevice(a->device, 0);
+    return true;
+}
+
+void APU_SetRecorder(APU *a, RECORDER *r){
+    if(a != NULL){
+        Refresh(a);
+        a->recorder = r;
+        if(r != NULL)
+            Recorder_Change(r, a->time, a->mixed);
+    }
+}
+
 void APU_Destroy(APU *a){
-    SDL_CloseAudio();
     if(a != NULL){
+        // Stops the callback before the ring goes away
+        if(a->device != 0){
+            SDL_CloseAudioDevice(a->device);
+        }
+        if(a->overruns > 0 || SDL_AtomicGet(&a->underruns) > 0){
+            printf("Audio dropped %u samples and ran %d samples short.\n", a->overruns, SDL_AtomicGet(&a->underruns));
+        }
+        Blip_Destroy(a->blip);
         free(a);
     }
 }
 
+void APU_SetLatency(APU *a, int ms){
+    int samples = ms * SAMPLE_FREQUENCY / 1000;
+    // At least one callback's worth, and room for one more on top
+    if(samples < AUDIO_DEVICE_SAMPLES)
+        samples = AUDIO_DEVICE_SAMPLES;
+    if(samples > AUDIO_RING_LENGTH - AUDIO_DEVICE_SAMPLES)
+        samples = AUDIO_RING_LENGTH - AUDIO_DEVICE_SAMPLES;
+    if(a->device != 0)
+        SDL_LockAudioDevice(a->device);
+    a->latency = samples;
+    if(a->device != 0)
+        SDL_UnlockAudioDevice(a->device);
+}
+
 void APU_SetMemory(APU *a, MEMORY *mem){
     if(a != NULL){
         a->memory = mem;
     }
 }
 
-void APU_Update(APU *a, int cycles){
+void APU_Startup(APU *a){
     if(a != NULL){
-        a->sample_timer -= cycles;
-        if(a->sample_timer <= 0){
-            a->sample_timer += CYCLES_PER_SAMPLE;
-            a->audio_buffer[a->sample_number] = 0;
-            a->audio_buffer[a->sample_number + 1] = 0;
-            a->nr51 = Mem_ReadByte(a->memory, NR51_ADDR);
+        // Reading them through memory would just ask the APU
+        for(int i = 0; i < APU_REGISTERS; i++){
+            a->regs[i] = a->memory->mem[NR10_ADDR + i - 0xC000];
+        }
+        // NR52's low bits say which channels the boot ROM left on. Their
+        // envelopes have long since faded out, but they still run at the
+        // frequencies it left behind
+        for(int n = 0; n < 4; n++){
+            CHANNEL *ch = &a->channel[n];
+            ch->enabled = TEST_BIT(REG(a, NR52_ADDR), n);
+            ch->volume = 0;
+            ch->lfsr = 0x7FFF;
+            SetPeriod(a, n);
+            ch->timer = ch->period;
+        }
+        REG(a, NR52_ADDR) &= 0x80;
+    }
+}
 
-            BYTE nr50 = Mem_ReadByte(a->memory, NR50_ADDR);
+void APU_SetClock(APU *a, const unsigned int *clock){
+    if(a != NULL){
+        a->clock = clock;
+    }
+}
 
-            Update_Ch1(a, cycles);
-            Update_Ch2(a, cycles);
-            Update_Ch3(a, cycles);
-            Update_Ch4(a, cycles);
+void APU_WriteRegister(APU *a, WORD addr, BYTE data){
+    if(a != NULL){
+        // Everything up to now happened with the old value
+        CatchUp(a);
+        if(addr == NR52_ADDR){
+            if(!TEST_BIT(data, 7) && TEST_BIT(REG(a, NR52_ADDR), 7))
+                PowerOff(a);
+            else if(TEST_BIT(data, 7) && !TEST_BIT(REG(a, NR52_ADDR), 7))
+                a->sequencer_step = 0;
+            REG(a, NR52_ADDR) = data & 0x80;
+            return;
+        }
+        // While the APU is off, only wave RAM can be written
+        if(!TEST_BIT(REG(a, NR52_ADDR), 7) && addr < WAVE_PATTERN_RAM)
+            return;
+        REG(a, addr) = data;
+        if(addr <= NR44_ADDR){
+            WriteChannel(a, (addr - NR10_ADDR) / 5, (addr - NR10_ADDR) % 5);
+        }
+        else if(addr == NR50_ADDR || addr == NR51_ADDR){
+            Mix(a, a->time);
+        }
+    }
+}
 
-            ADJUST_VOLUME(a->audio_buffer[a->sample_number], (nr50 & 0x70) >> 4);
-            ADJUST_VOLUME(a->audio_buffer[a->sample_number + 1], nr50 & 0x07);
+BYTE APU_ReadRegister(APU *a, WORD addr){
+    if(a == NULL)
+        return 0xFF;
+    if(addr == NR52_ADDR){
+        // Channels turn themselves off, so the status has to be up to now
+        CatchUp(a);
+        BYTE status = REG(a, NR52_ADDR) | read_masks[addr - NR10_ADDR];
+        for(int n = 0; n < 4; n++){
+            if(a->channel[n].enabled)
+                status |= 0x01 << n;
+        }
+        return status;
+    }
+    return REG(a, addr) | read_masks[addr - NR10_ADDR];
+}
+
+// Turning the APU off clears every register but wave RAM, which stops the channels
+static void PowerOff(APU *a){
+    memset(a->regs, 0, NR52_ADDR - NR10_ADDR);
+    for(int n = 0; n < 4; n++){
+        Disable(a, n);
+    }
+    a->sweep_enabled = false;
+    Mix(a, a->time);
+}
+
+/**
+ * Runs the channels from where they left off up to the clock. Their
+ * volumes and lengths only change on the frame sequencer's steps, so
+ * they're run up to each step, then the step is taken.
+ */
+static void CatchUp(APU *a){
+    unsigned int now = *a->clock;
+    if(Silent(a)){
+        if(now > a->time){
+            CatchUpSilent(a, now - a->time);
+            a->time = now;
+        }
+        return;
+    }
+    while(now > a->time){
+        int cycles = now - a->time;
+        if(cycles > a->sequencer_timer)
+            cycles = a->sequencer_timer;
+        Update_Ch1(a, cycles);
+        Update_Ch2(a, cycles);
+        Update_Ch3(a, cycles);
+        Update_Ch4(a, cycles);
+        a->time += cycles;
+        a->sequencer_timer -= cycles;
+        if(a->sequencer_timer == 0){
+            a->sequencer_timer = CYCLES_PER_FRAME;
+            StepSequencer(a);
+        }
+    }
+}
+
+// Nothing is listening: no device to play to and no recorder
+static bool Silent(APU *a){
+    return a->device == 0 && a->recorder == NULL;
+}
+
+/**
+ * Catching up with nothing listening. The channels' timers don't matter,
+ * only what a game can read back: whether each channel is on, and the
+ * lengths, volumes and sweep that decide when that changes. Those only
+ * change on the frame sequencer's steps, so this works out how many of
+ * each kind of step fell in the cycles and applies them all at once.
+ */
+static void CatchUpSilent(APU *a, int cycles){
+    if(cycles < a->sequencer_timer){
+        a->sequencer_timer -= cycles;
+        return;
+    }
+    int elapsed = cycles - a->sequencer_timer;
+    int steps = 1 + elapsed / CYCLES_PER_FRAME;
+    int first = a->sequencer_step;
+    a->sequencer_timer = CYCLES_PER_FRAME - elapsed % CYCLES_PER_FRAME;
+    a->sequencer_step = (first + steps) % 8;
+
+    int lengths = CountSteps(first, steps, 0x55);
+    for(int n = 0; n < 4; n++){
+        CHANNEL *ch = &a->channel[n];
+        if(TEST_BIT(NRX(a, n, 4), 6) && ch->length > 0){
+            if(lengths >= ch->length){
+                ch->length = 0;
+                ch->enabled = false;
+            }
+            else{
+                ch->length -= lengths;
+            }
+        }
+    }
+    // The sweep can turn channel 1 off, and each clock depends on the last
+    int sweeps = CountSteps(first, steps, 0x44);
+    for(int i = 0; i < sweeps && a->sweep_enabled; i++){
+        ClockSweep(a);
+    }
+    int envelopes = CountSteps(first, steps, 0x80);
+    SkipEnvelope(a, 0, envelopes);
+    SkipEnvelope(a, 1, envelopes);
+    SkipEnvelope(a, 3, envelopes);
+}
+
+// How many of steps frame sequencer steps, starting at step first, are
+// ones set in mask (bit n for step n)
+static int CountSteps(int first, int steps, BYTE mask){
+    int count = 0;
+    for(int i = 0; i < 8; i++){
+        if(TEST_BIT(mask, i))
+            count += steps / 8;
+    }
+    for(int i = 0; i < steps % 8; i++){
+        if(TEST_BIT(mask, (first + i) % 8))
+            count++;
+    }
+    return count;
+}
+
+// Puts the channels' outputs and the mix back in step after running silent
+static void Refresh(APU *a){
+    for(int n = 0; n < 4; n++){
+        a->channel[n].output = Level(a, n);
+    }
+    Mix(a, a->time);
+}
+
+void APU_EndFrame(APU *a){
+    if(a != NULL){
+        CatchUp(a);
+        if(a->recorder != NULL){
+            Recorder_EndFrame(a->recorder, a->time);
+        }
+        if(a->device != 0){
+            int16_t samples[BLIP_BUFFER_SIZE][2];
+            Blip_EndFrame(a->blip, a->time);
+            int count = Blip_ReadSamples(a->blip, samples, BLIP_BUFFER_SIZE);
+            PushSamples(a, samples, count);
+#ifdef DYNAMIC_RATE_CONTROL
+            AdjustRate(a);
+#endif // DYNAMIC_RATE_CONTROL
+        }
+        a->time = 0;
+    }
+}
+
+#ifdef DYNAMIC_RATE_CONTROL
+// Makes fewer samples out of the next frame while the ring is fuller than
+// the latency, and more while it's emptier, by up to AUDIO_RATE_CONTROL
+static void AdjustRate(APU *a){
+    int fill = (unsigned int) SDL_AtomicGet(&a->head) - (unsigned int) SDL_AtomicGet(&a->tail);
+    double error = (double) (fill - a->latency) / a->latency;
+    if(error > 1.0)
+        error = 1.0;
+    if(error < -1.0)
+        error = -1.0;
+    double rate = SAMPLE_FREQUENCY * (1.0 - AUDIO_RATE_CONTROL * error);
+    Blip_SetRates(a->blip, CLK_F, rate);
+}
+#endif // DYNAMIC_RATE_CONTROL
+
+// Only this end moves head, so it can be read without worrying about the
+// callback. Setting it publishes the samples written before it
+static void PushSamples(APU *a, int16_t samples[][2], int count){
+    unsigned int head = SDL_AtomicGet(&a->head);
+    int space = AUDIO_RING_LENGTH - (head - (unsigned int) SDL_AtomicGet(&a->tail));
+    if(count > space){
+        a->overruns += count - space;
+        count = space;
+    }
+    // The samples can wrap around the end of the ring
+    int start = head % AUDIO_RING_LENGTH;
+    int first = (count < AUDIO_RING_LENGTH - start) ? count : AUDIO_RING_LENGTH - start;
+    ConvertSamples(a->ring + start, samples, first);
+    ConvertSamples(a->ring, samples + first, count - first);
+    SDL_AtomicSet(&a->head, head + count);
+}
 
 #ifdef FLOAT32_AUDIO
-            NORMALIZE_SAMPLE(a->audio_buffer[a->sample_number]);
-            NORMALIZE_SAMPLE(a->audio_buffer[a->sample_number + 1]);
+// Scales samples to [-1.0, 1.0), 4 (SSE2) or 8 (AVX2) numbers at a time
+static void ConvertSamples(AudioSample out[][2], int16_t samples[][2], int count){
+    const float scale = 1.0f / 32768;
+    float *o = &out[0][0];
+    const int16_t *in = &samples[0][0];
+    int n = count * 2;
+    int i = 0;
+#if defined(__AVX2__)
+    for(; i + 8 <= n; i += 8){
+        __m256i wide = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (in + i)));
+        _mm256_storeu_ps(o + i, _mm256_mul_ps(_mm256_cvtepi32_ps(wide), _mm256_set1_ps(scale)));
+    }
+#elif defined(__SSE2__)
+    for(; i + 4 <= n; i += 4){
+        __m128i narrow = _mm_loadl_epi64((const __m128i *) (in + i));
+        // Sign extends each number into the top of 32 bits, and back down
+        __m128i wide = _mm_srai_epi32(_mm_unpacklo_epi16(narrow, narrow), 16);
+        _mm_storeu_ps(o + i, _mm_mul_ps(_mm_cvtepi32_ps(wide), _mm_set1_ps(scale)));
+    }
+#endif
+    for(; i < n; i++){
+        o[i] = in[i] * scale;
+    }
+}
+#else
+static void ConvertSamples(AudioSample out[][2], int16_t samples[][2], int count){
+    memcpy(out, samples, count * sizeof(out[0]));
+}
 #endif // FLOAT32_AUDIO
-            
-            a->sample_number += 2;
-            if(a->sample_number == AUDIO_BUFFER_LENGTH){
-                SDL_QueueAudio(1, a->audio_buffer, AUDIO_BUFFER_LENGTH * sizeof(AudioSample));
-                a->sample_number = 0;
-            }
+
+// Runs on SDL's audio thread whenever the device needs more samples
+static void AudioCallback(void *data, Uint8 *stream, int len){
+    APU *a = data;
+    AudioSample (*out)[2] = (AudioSample (*)[2]) stream;
+    int wanted = len / sizeof(out[0]);
+    unsigned int tail = SDL_AtomicGet(&a->tail);
+    int available = (unsigned int) SDL_AtomicGet(&a->head) - tail;
+    int count = 0;
+
+    if(!a->playing && available >= a->latency){
+        a->playing = true;
+    }
+    if(a->playing){
+        count = (available < wanted) ? available : wanted;
+        // The samples can wrap around the end of the ring
+        int start = tail % AUDIO_RING_LENGTH;
+        int first = (count < AUDIO_RING_LENGTH - start) ? count : AUDIO_RING_LENGTH - start;
+        memcpy(out, a->ring[start], first * sizeof(out[0]));
+        memcpy(out + first, a->ring[0], (count - first) * sizeof(out[0]));
+        SDL_AtomicSet(&a->tail, tail + count);
+        if(count < wanted){
+            SDL_AtomicAdd(&a->underruns, wanted - count);
+            a->playing = false;
         }
     }
+    // Silence is 0 in both sample formats
+    memset(out + count, 0, (wanted - count) * sizeof(out[0]));
 }
 
-static void Update_Ch1(APU *a, int cycles){
-    /***** Incomplete *****/
-    AudioSample value;
-    int frequency, wave_duty;
-    BYTE nr11, nr12, nr13, nr14;
+// What channel n is putting out right now, 0-15
+static int Level(APU *a, int n){
+    const CHANNEL *ch = &a->channel[n];
+    if(!ch->enabled){
+        return 0;
+    }
+    switch(n){
+        case 0:
+        case 1:
+            return square_wave_table[NRX(a, n, 1) >> 6][ch->step] * ch->volume;
+        case 2:{
+            // Two samples a byte, high nibble first
+            BYTE sample = REG(a, WAVE_PATTERN_RAM + ch->step / 2);
+            sample = (ch->step % 2 == 0) ? sample >> 4 : sample & 0x0F;
+            return sample >> wave_volume_shift[(NRX(a, 2, 2) >> 5) & 0x03];
+        }
+        default:
+            // The output is high while bit 0 is clear
+            return (ch->lfsr & 0x01) ? 0 : ch->volume;
+    };
+}
 
-    nr11 = Mem_ReadByte(a->memory, NR11_ADDR); // Sound length + Wave duty
-    nr12 = Mem_ReadByte(a->memory, NR12_ADDR); // Volume envelope
-    nr13 = Mem_ReadByte(a->memory, NR13_ADDR); // Frequency lo
-    nr14 = Mem_ReadByte(a->memory, NR14_ADDR); // Initial + Counter/Continuous + Frequency hi
+// Updates channel n's output, at time cycles into the frame
+static void SetOutput(APU *a, int n, unsigned int time){
+    // Nothing to send it to. Refresh catches up when something listens
+    if(Silent(a)){
+        return;
+    }
+    int value = Level(a, n);
+    if(a->channel[n].output != value){
+        a->channel[n].output = value;
+        Mix(a, time);
+    }
+}
 
-    frequency = nr13;
-    frequency |= (nr14 & 0x7) << 8;
-    a->frame_countdown[0] = (2048 - frequency) * 4;
+// Adds up the channels sent to each side (NR51 bits 4-7 are left, 0-3 are
+// right) at that side's master volume (NR50 bits 4-6 and 0-2), and sends
+// any change to the blip buffer and the recorder
+static void Mix(APU *a, unsigned int time){
+    int level[2] = {0, 0};
+    BYTE nr50 = REG(a, NR50_ADDR);
+    BYTE nr51 = REG(a, NR51_ADDR);
+    for(int i = 0; i < 4; i++){
+        if(TEST_BIT(nr51, i + 4))
+            level[0] += a->channel[i].output;
+        if(TEST_BIT(nr51, i))
+            level[1] += a->channel[i].output;
+    }
+    level[0] *= (((nr50 >> 4) & 0x07) + 1) * VOLUME_UNIT;
+    level[1] *= ((nr50 & 0x07) + 1) * VOLUME_UNIT;
+    if(level[0] == a->mixed[0] && level[1] == a->mixed[1]){
+        return;
+    }
+    if(a->device != 0){
+        Blip_AddDelta(a->blip, time, level[0] - a->mixed[0], level[1] - a->mixed[1]);
+    }
+    a->mixed[0] = level[0];
+    a->mixed[1] = level[1];
+    if(a->recorder != NULL){
+        Recorder_Change(a->recorder, time, level);
+    }
+}
 
-    wave_duty = nr11 >> 6;
+// Applies a write to register x (0-4) of channel n
+static void WriteChannel(APU *a, int n, int x){
+    CHANNEL *ch = &a->channel[n];
+    switch(x){
+        case 0:
+            // NR30 turns the wave channel's DAC on and off. NR10 is read
+            // when the sweep is clocked
+            if(n == 2 && !TEST_BIT(NRX(a, 2, 0), 7))
+                Disable(a, 2);
+            break;
+        case 1:
+            // Sound length = (64 - t1)/256 seconds, (256 - t1)/256 for the wave channel
+            ch->length = (n == 2) ? 256 - NRX(a, 2, 1) : 64 - (NRX(a, n, 1) & 0x3F);
+            break;
+        case 2:
+            if(n == 2){
+                // The wave channel's volume
+                SetOutput(a, 2, a->time);
+            }
+            else if((NRX(a, n, 2) & 0xF8) == 0){
+                // With the top 5 bits of NRx2 clear the DAC is off, and the channel with it
+                Disable(a, n);
+            }
+            break;
+        default:
+            // The new period starts the next time the timer runs out
+            SetPeriod(a, n);
+            // Check Initial flag
+            if(x == 4 && TEST_BIT(NRX(a, n, 4), 7))
+                Trigger(a, n);
+            break;
+    };
+}
+
+// Works out channel n's period from its frequency registers (NR43 for the noise)
+static void SetPeriod(APU *a, int n){
+    CHANNEL *ch = &a->channel[n];
+    if(n == 3){
+        BYTE nr43 = NRX(a, 3, 3);
+        ch->period = noise_divisor[nr43 & 0x07] << (nr43 >> 4);
+    }
+    else{
+        // Frequency = 131072/(2048-x) Hz for the square waves' 8
+        // steps, and 65536/(2048-x) Hz for the wave's 32
+        int frequency = NRX(a, n, 3) | ((NRX(a, n, 4) & 0x07) << 8);
+        ch->period = (2048 - frequency) * ((n == 2) ? 2 : 4);
+    }
+}
 
-    // Check Initial flag
-    if(TEST_BIT(nr14, 7)){
-        Mem_WriteByte(a->memory, NR14_ADDR, nr14 & 0x7F); // Clear initial flag in memory
-        // Reset timers and sequence
-        float t1 = (float) (nr11 & 0x3F);
-        // Sound length = (64 - t1)/256 seconds
-        a->sound_timer[0] = us_to_cycles(((64.0 - t1) / 256.0) * 1000000.0);
-        a->frame_timer[0] = a->frame_countdown[1];
-        a->sequence[0] = 0;
-        // Reset evelope value and timer
-        float n = (float) (nr12 & 0x07);
-        a->envelope_enable[0] = (n == 0) ? false : true;
-        a->envelope_value[0] = nr12 >> 4;
-        // Length of 1 step = n/64 seconds
-        a->envelope_timer[0] = us_to_cycles((n / 64.0) / 1000000.0);
+static void Trigger(APU *a, int n){
+    CHANNEL *ch = &a->channel[n];
+    ch->enabled = (n == 2) ? TEST_BIT(NRX(a, 2, 0), 7) : (NRX(a, n, 2) & 0xF8) != 0;
+    if(ch->length == 0)
+        ch->length = (n == 2) ? 256 : 64;
+    ch->timer = ch->period;
+    ch->step = 0;
+    ch->lfsr = 0x7FFF;
+    ch->volume = NRX(a, n, 2) >> 4;
+    ch->envelope_timer = NRX(a, n, 2) & 0x07;
+    if(n == 0){
+        BYTE nr10 = NRX(a, 0, 0);
+        a->sweep_frequency = NRX(a, 0, 3) | ((NRX(a, 0, 4) & 0x07) << 8);
+        a->sweep_timer = ((nr10 >> 4) & 0x07) ? (nr10 >> 4) & 0x07 : 8;
+        a->sweep_enabled = (nr10 & 0x77) != 0;
+        // With a shift, the next frequency is worked out right away, and
+        // if it's out of range the channel stops before it starts
+        if((nr10 & 0x07) && SweepFrequency(a) > 2047)
+            ch->enabled = false;
     }
+    SetOutput(a, n, a->time);
+}
+
+static void Disable(APU *a, int n){
+    a->channel[n].enabled = false;
+    SetOutput(a, n, a->time);
+}
 
-    if(a->sound_timer[0] > 0 || !TEST_BIT(nr14, 6)){
-        a->sound_timer[0] -= cycles;
-        a->frame_timer[0] -= cycles;
-        if(a->frame_timer[0] <= 0){
-            a->frame_timer[0] = a->frame_countdown[1];
-            a->sequence[0] = (a->sequence[0] + 1) % 8;
+/**
+ * The frame sequencer has 8 steps at 512 Hz. The length counters are
+ * clocked on every other one (256 Hz), the sweep on 2 and 6 (128 Hz) and
+ * the envelopes on 7 (64 Hz).
+ */
+static void StepSequencer(APU *a){
+    int step = a->sequencer_step;
+    a->sequencer_step = (step + 1) % 8;
+    if(step % 2 == 0){
+        for(int n = 0; n < 4; n++){
+            CHANNEL *ch = &a->channel[n];
+            if(TEST_BIT(NRX(a, n, 4), 6) && ch->length > 0 && --ch->length == 0)
+                Disable(a, n);
         }
+    }
+    if(step == 2 || step == 6){
+        ClockSweep(a);
+    }
+    if(step == 7){
+        ClockEnvelope(a, 0);
+        ClockEnvelope(a, 1);
+        ClockEnvelope(a, 3);
+    }
+}
 
-        value = square_wave_table[wave_duty][a->sequence[0]];
-        a->audio_buffer[a->sample_number] = value;
-        a->audio_buffer[a->sample_number + 1] = value;
+// Every NRx2 bits 0-2 clocks, the volume goes up (bit 3 set) or down a step
+static void ClockEnvelope(APU *a, int n){
+    CHANNEL *ch = &a->channel[n];
+    BYTE nrx2 = NRX(a, n, 2);
+    if((nrx2 & 0x07) == 0 || --ch->envelope_timer > 0){
+        return;
+    }
+    ch->envelope_timer = nrx2 & 0x07;
+    if(TEST_BIT(nrx2, 3) && ch->volume < 15){
+        ch->volume++;
+        SetOutput(a, n, a->time);
+    }
+    else if(!TEST_BIT(nrx2, 3) && ch->volume > 0){
+        ch->volume--;
+        SetOutput(a, n, a->time);
     }
 }
 
-static void Update_Ch2(APU *a, int cycles){
-    AudioSample value;
-    int frequency, wave_duty;
-    BYTE nr21, nr22, nr23, nr24;
-
-    nr21 = Mem_ReadByte(a->memory, NR21_ADDR); // Sound length + Wave duty
-    nr22 = Mem_ReadByte(a->memory, NR22_ADDR); // Volume envelope
-    nr23 = Mem_ReadByte(a->memory, NR23_ADDR); // Frequency lo
-    nr24 = Mem_ReadByte(a->memory, NR24_ADDR); // Initial + Counter/Continuous + Frequency hi
-
-    frequency = nr23;
-    frequency |= (nr24 & 0x7) << 8;
-    // Frequency = 131072/(2048-x) Hz
-    a->frame_countdown[1] = (2048 - frequency) * 4;
-
-    wave_duty = nr21 >> 6;
-
-    // Check Initial flag
-    if(TEST_BIT(nr24, 7)){
-        Mem_WriteByte(a->memory, NR24_ADDR, nr24 & 0x7F); // Clear initial flag in memory
-        // Reset timers and sequence
-        float t1 = (float) (nr21 & 0x3F);
-        // Sound length = (64 - t1)/256 seconds
-        a->sound_timer[1] = us_to_cycles(((64.0 - t1) / 256.0) * 1000000.0);
-        a->frame_timer[1] = a->frame_countdown[1];
-        a->sequence[1] = 0;
-        // Reset evelope value and timer
-        float n = (float) (nr22 & 0x07);
-        a->envelope_enable[1] = (n == 0) ? false : true;
-        a->envelope_value[1] = nr22 >> 4;
-        // Length of 1 step = n/64 seconds
-        a->envelope_timer[1] = us_to_cycles((n / 64.0) / 1000000.0);
-    }
-
-    // Only process sound information if the sound timer hasn't expired or continuous output is enabled
-    if(a->sound_timer[1] > 0 || !TEST_BIT(nr24, 6)){
-        a->sound_timer[1] -= cycles;
-        // Figure out location in the 8-step sequence (from square_wave_table)
-        a->frame_timer[1] -= cycles;
-        if(a->frame_timer[1] <= 0){
-            a->frame_timer[1] = a->frame_countdown[1];
-            a->sequence[1] = (a->sequence[1] + 1) % 8;
-            a->envelope_value[1] += (TEST_BIT(nr22, 1)) ? 255 : -255;
-            a->envelope_value[1] &= 0xFF;
-        }
-
-        // Adjust volume if the envelope timer has run out
-        a->envelope_timer[1] -= cycles;
-        if(a->envelope_enable[1] && a->envelope_timer[1] <= 0){
-            float n = (float) (nr22 & 0x07);
-            if(n == 0)
-                a->envelope_enable[1] = false;
-            a->envelope_timer[1] = us_to_cycles((n / 64.0) / 1000000.0);
-
-        }
-
-        value = (square_wave_table[wave_duty][a->sequence[1]] * a->envelope_value[1]) / 0xFFFF;
-
-        if(TEST_BIT(a->nr51, 1))
-            a->audio_buffer[a->sample_number] += value;
-        if(TEST_BIT(a->nr51, 5))
-            a->audio_buffer[a->sample_number + 1] += value;
+// clocks envelope clocks at once. The volume only goes one way, until it
+// stops at 0 or 15
+static void SkipEnvelope(APU *a, int n, int clocks){
+    CHANNEL *ch = &a->channel[n];
+    BYTE nrx2 = NRX(a, n, 2);
+    int period = nrx2 & 0x07;
+    if(period == 0 || clocks == 0){
+        return;
+    }
+    // A timer that's already run out steps on the next clock
+    if(ch->envelope_timer < 1)
+        ch->envelope_timer = 1;
+    if(clocks < ch->envelope_timer){
+        ch->envelope_timer -= clocks;
+        return;
+    }
+    int elapsed = clocks - ch->envelope_timer;
+    int volume_steps = 1 + elapsed / period;
+    ch->envelope_timer = period - elapsed % period;
+    if(TEST_BIT(nrx2, 3))
+        ch->volume = (ch->volume + volume_steps > 15) ? 15 : ch->volume + volume_steps;
+    else
+        ch->volume = (ch->volume - volume_steps < 0) ? 0 : ch->volume - volume_steps;
+}
+
+// The frequency after the next sweep: NR10 bits 0-2 are the shift, bit 3 the direction
+static int SweepFrequency(APU *a){
+    BYTE nr10 = NRX(a, 0, 0);
+    int change = a->sweep_frequency >> (nr10 & 0x07);
+    return TEST_BIT(nr10, 3) ? a->sweep_frequency - change : a->sweep_frequency + change;
+}
+
+// Every NR10 bits 4-6 clocks, channel 1's frequency is swept. Going past
+// 2047 turns the channel off
+static void ClockSweep(APU *a){
+    BYTE nr10 = NRX(a, 0, 0);
+    int period = (nr10 >> 4) & 0x07;
+    if(!a->sweep_enabled || --a->sweep_timer > 0){
+        return;
+    }
+    a->sweep_timer = period ? period : 8;
+    if(period == 0){
+        return;
     }
+    int frequency = SweepFrequency(a);
+    if(frequency > 2047){
+        Disable(a, 0);
+    }
+    else if(nr10 & 0x07){
+        a->sweep_frequency = frequency;
+        NRX(a, 0, 3) = frequency & 0xFF;
+        NRX(a, 0, 4) = (NRX(a, 0, 4) & 0xF8) | (frequency >> 8);
+        a->channel[0].period = (2048 - frequency) * 4;
+        if(SweepFrequency(a) > 2047)
+            Disable(a, 0);
+    }
+}
+
+// Clocks a channel's timer over cycles cycles without looking at its
+// output. Returns how many times it ran out
+static int SkipSteps(CHANNEL *ch, int cycles){
+    if(ch->period <= 0){
+        return 0;
+    }
+    if(cycles < ch->timer){
+        ch->timer -= cycles;
+        return 0;
+    }
+    int elapsed = cycles - ch->timer;
+    ch->timer = ch->period - elapsed % ch->period;
+    return 1 + elapsed / ch->period;
+}
+
+static void Update_Ch1(APU *a, int cycles){
+    UpdateTone(a, 0, 8, cycles);
+}
+
+static void Update_Ch2(APU *a, int cycles){
+    UpdateTone(a, 1, 8, cycles);
 }
 
 static void Update_Ch3(APU *a, int cycles){
+    UpdateTone(a, 2, 32, cycles);
+}
 
+/**
+ * Runs a square wave or the wave channel for cycles cycles, from a->time,
+ * stepping through steps outputs. Nothing happens between steps, so that's
+ * the only time it does anything, and while it can't be heard it doesn't
+ * even do that.
+ */
+static void UpdateTone(APU *a, int n, int steps, int cycles){
+    CHANNEL *ch = &a->channel[n];
+    // A channel without a period would never step
+    if(!ch->enabled || ch->period <= 0){
+        return;
+    }
+    bool silent = (n == 2) ? ((NRX(a, 2, 2) >> 5) & 0x03) == 0 : ch->volume == 0;
+    unsigned int time = a->time;
+    if(!silent){
+        while(ch->timer <= cycles){
+            time += ch->timer;
+            cycles -= ch->timer;
+            ch->timer = ch->period;
+            ch->step = (ch->step + 1) % steps;
+            SetOutput(a, n, time);
+        }
+    }
+    ch->step = (ch->step + SkipSteps(ch, cycles)) % steps;
 }
 
+/**
+ * Runs the noise channel for cycles cycles, from a->time. Rather than
+ * clocking the LFSR, it finds the LFSR's position in its sequence and
+ * jumps straight to the next time its output changes.
+ */
 static void Update_Ch4(APU *a, int cycles){
+    CHANNEL *ch = &a->channel[3];
+    if(!ch->enabled || ch->period <= 0){
+        return;
+    }
+    bool narrow = TEST_BIT(NRX(a, 3, 3), 3);
+    const LFSR_TABLE *t = &lfsr_tables[narrow];
+    int position = t->position[ch->lfsr & t->mask];
+    if(position == LFSR_LOCKED){
+        return;
+    }
+    unsigned int time = a->time;
+    if(ch->volume != 0){
+        for(;;){
+            int run = t->runs[position];
+            long long until = ch->timer + (long long) (run - 1) * ch->period;
+            if(until > cycles)
+                break;
+            time += until;
+            cycles -= until;
+            ch->timer = ch->period;
+            position = (position + run) % t->length;
+            ch->lfsr = t->states[position];
+            SetOutput(a, 3, time);
+        }
+    }
+    position = (position + SkipSteps(ch, cycles)) % t->length;
+    ch->lfsr = LfsrState(narrow, position);
+}
 
+/**
+ * Builds the sequence of an LFSR of width bits. Each clock, bit 0 XOR bit 1
+ * is shifted in at the top. Both widths go through every state but 0.
+ */
+static void InitLfsrTable(LFSR_TABLE *t, int width){
+    WORD lfsr = t->mask;
+    t->position[0] = LFSR_LOCKED;
+    for(int i = 0; i < t->length; i++){
+        t->states[i] = lfsr;
+        t->position[lfsr] = i;
+        WORD feedback = (lfsr ^ (lfsr >> 1)) & 0x01;
+        lfsr = (lfsr >> 1) | (feedback << (width - 1));
+    }
+    // Going backwards, each run is one longer than the next one, until the
+    // output changes. The sequence wraps around, so start at a change
+    int end = 0;
+    while((t->states[end] & 0x01) == (t->states[(end + t->length - 1) % t->length] & 0x01))
+        end++;
+    for(int i = t->length - 1; i >= 0; i--){
+        int position = (end + i) % t->length;
+        int next = (position + 1) % t->length;
+        bool change = (t->states[position] & 0x01) != (t->states[next] & 0x01);
+        t->runs[position] = change ? 1 : t->runs[next] + 1;
+    }
+}
+
+/**
+ * The full 15 bits of the LFSR at position. In 7 bit mode each clock also
+ * shifts the feedback in at bit 14, so bits 7-14 hold the last 8 values of
+ * bit 6.
+ */
+static WORD LfsrState(bool narrow, int position){
+    if(!narrow){
+        return lfsr15_states[position];
+    }
+    WORD lfsr = lfsr7_states[position];
+    for(int i = 0; i < 8; i++){
+        WORD bit6 = (lfsr7_states[(position + LFSR7_LENGTH - i) % LFSR7_LENGTH] >> 6) & 0x01;
+        lfsr |= bit6 << (14 - i);
+    }
+    return lfsr;
 }
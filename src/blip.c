@@ -0,0 +1,159 @@
+#include "blip.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Fraction of the Nyquist frequency the steps are band-limited to. A bit
+// under 1, so the kernel's roll-off is done before it starts to alias
+#define BLIP_CUTOFF 0.9
+
+// The band-limited impulse for each phase, summing to 1 << BLIP_DELTA_BITS.
+// Each tap is {tap, 0, tap, 0}: with a left and right step as two 32 bit
+// numbers, one multiply-add of pairs of 16 bit numbers (_mm_madd_epi16)
+// gives the tap times each of them
+static int16_t step_table[BLIP_PHASES][BLIP_WIDTH][4];
+static bool step_table_ready = false;
+
+static void InitStepTable();
+
+
+BLIP_BUFFER *Blip_Create(){
+    BLIP_BUFFER *blip = malloc(sizeof(BLIP_BUFFER));
+    if(blip != NULL){
+        memset(blip, 0, sizeof(BLIP_BUFFER));
+        if(!step_table_ready){
+            InitStepTable();
+        }
+    }
+    return blip;
+}
+
+void Blip_Destroy(BLIP_BUFFER *b){
+    if(b != NULL){
+        free(b);
+    }
+}
+
+/**
+ * Tap n of phase p is the impulse at n - (BLIP_WIDTH / 2 - 1) - p / BLIP_PHASES
+ * samples from the step: a sinc cut off at BLIP_CUTOFF, under a Blackman
+ * window as wide as the taps. Each phase is rounded to whole numbers and
+ * then nudged so it sums to exactly 1 << BLIP_DELTA_BITS, or steps would
+ * leave a little DC behind.
+ */
+static void InitStepTable(){
+    for(int phase = 0; phase < BLIP_PHASES; phase++){
+        double taps[BLIP_WIDTH];
+        double sum = 0.0;
+        for(int n = 0; n < BLIP_WIDTH; n++){
+            double x = n - (BLIP_WIDTH / 2 - 1) - (double) phase / BLIP_PHASES;
+            double angle = M_PI * BLIP_CUTOFF * x;
+            double sinc = (x == 0.0) ? 1.0 : sin(angle) / angle;
+            double window = 0.42 + 0.5 * cos(2 * M_PI * x / BLIP_WIDTH) + 0.08 * cos(4 * M_PI * x / BLIP_WIDTH);
+            taps[n] = sinc * window;
+            sum += taps[n];
+        }
+        int rounded[BLIP_WIDTH];
+        int total = 0;
+        for(int n = 0; n < BLIP_WIDTH; n++){
+            rounded[n] = (int) lround(taps[n] / sum * (1 << BLIP_DELTA_BITS));
+            total += rounded[n];
+        }
+        rounded[BLIP_WIDTH / 2 - 1] += (1 << BLIP_DELTA_BITS) - total;
+        for(int n = 0; n < BLIP_WIDTH; n++){
+            step_table[phase][n][0] = step_table[phase][n][2] = rounded[n];
+            step_table[phase][n][1] = step_table[phase][n][3] = 0;
+        }
+    }
+    step_table_ready = true;
+}
+
+void Blip_SetRates(BLIP_BUFFER *b, double clock_rate, double sample_rate){
+    b->factor = (uint64_t) ceil(sample_rate / clock_rate * 4294967296.0);
+}
+
+void Blip_AddDelta(BLIP_BUFFER *b, unsigned int time, int left, int right){
+    uint64_t position = time * b->factor + b->offset;
+    int (*out)[2] = b->buffer + (position >> 32);
+    const int16_t (*taps)[4] = step_table[(position >> (32 - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1)];
+#if defined(__AVX2__)
+    __m256i delta = _mm256_set_epi32(right, left, right, left, right, left, right, left);
+    for(int n = 0; n < BLIP_WIDTH; n += 4){
+        __m256i sum = _mm256_loadu_si256((const __m256i *) out[n]);
+        __m256i step = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *) taps[n]), delta);
+        _mm256_storeu_si256((__m256i *) out[n], _mm256_add_epi32(sum, step));
+    }
+#elif defined(__SSE2__)
+    __m128i delta = _mm_set_epi32(right, left, right, left);
+    for(int n = 0; n < BLIP_WIDTH; n += 2){
+        __m128i sum = _mm_loadu_si128((const __m128i *) out[n]);
+        __m128i step = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) taps[n]), delta);
+        _mm_storeu_si128((__m128i *) out[n], _mm_add_epi32(sum, step));
+    }
+#else
+    for(int n = 0; n < BLIP_WIDTH; n++){
+        out[n][0] += taps[n][0] * left;
+        out[n][1] += taps[n][0] * right;
+    }
+#endif
+}
+
+void Blip_EndFrame(BLIP_BUFFER *b, unsigned int time){
+    b->offset += time * b->factor;
+    b->available = b->offset >> 32;
+}
+
+/**
+ * Each sample is where the running sum was before the sample's difference
+ * is added to it. A little of the sum leaks away every sample, which takes
+ * DC out. Every sample depends on the one before, so there's nothing to do
+ * at once but the two sides.
+ */
+int Blip_ReadSamples(BLIP_BUFFER *b, int16_t out[][2], int count){
+    if(count > b->available){
+        count = b->available;
+    }
+#if defined(__SSE2__)
+    __m128i sum = _mm_loadl_epi64((const __m128i *) b->integrator);
+    for(int i = 0; i < count; i++){
+        // Saturating to 16 bits is the clamp
+        __m128i sample = _mm_packs_epi32(_mm_srai_epi32(sum, BLIP_DELTA_BITS), _mm_setzero_si128());
+        int pair = _mm_cvtsi128_si32(sample);
+        memcpy(out[i], &pair, sizeof(pair));
+        sum = _mm_add_epi32(sum, _mm_loadl_epi64((const __m128i *) b->buffer[i]));
+        sample = _mm_srai_epi32(_mm_unpacklo_epi16(sample, sample), 16);
+        sum = _mm_sub_epi32(sum, _mm_slli_epi32(sample, BLIP_DELTA_BITS - BLIP_BASS_SHIFT));
+    }
+    _mm_storel_epi64((__m128i *) b->integrator, sum);
+#else
+    for(int side = 0; side < 2; side++){
+        int sum = b->integrator[side];
+        for(int i = 0; i < count; i++){
+            int sample = sum >> BLIP_DELTA_BITS;
+            sum += b->buffer[i][side];
+            if(sample > INT16_MAX)
+                sample = INT16_MAX;
+            if(sample < INT16_MIN)
+                sample = INT16_MIN;
+            out[i][side] = sample;
+            sum -= sample << (BLIP_DELTA_BITS - BLIP_BASS_SHIFT);
+        }
+        b->integrator[side] = sum;
+    }
+#endif
+
+    // The steps near the end of the frame reach into the samples after it
+    int left = b->available - count + BLIP_WIDTH;
+    memmove(b->buffer, b->buffer + count, left * sizeof(b->buffer[0]));
+    memset(b->buffer + left, 0, count * sizeof(b->buffer[0]));
+    b->offset -= (uint64_t) count << 32;
+    b->available -= count;
+    return count;
+}
@@ -0,0 +1,383 @@
+#include "capture.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#define PIPE_MODE "wb"
+#else
+#define PIPE_MODE "w"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Frames per second the DMG actually runs at: 4194304 Hz / 70224 cycles
+#define Y4M_HEADER "YUV4MPEG2 W160 H144 F4194304:70224 Ip A1:1 C444\n"
+
+#define PNG_ROW_BYTES (SCREEN_WIDTH / 4)
+
+struct capture_shm{
+#ifndef _WIN32
+    char *name;
+    size_t size;
+    CAPTURE_SHM_HEADER *header;
+    PIXEL (*slots)[SCREEN_HEIGHT][SCREEN_WIDTH];
+#endif
+};
+
+static int Writer(void *data);
+static bool OpenShm(CAPTURE *c, const char *name);
+static void CloseShm(CAPTURE *c);
+static void WriteShm(CAPTURE *c, PIXEL frame[SCREEN_HEIGHT][SCREEN_WIDTH]);
+
+
+CAPTURE *Capture_Create(const char *path, CAPTURE_FORMAT format){
+    CAPTURE *capture = malloc(sizeof(CAPTURE));
+    if(capture == NULL)
+        return NULL;
+    memset(capture, 0, sizeof(CAPTURE));
+    capture->format = format;
+
+    bool opened = false;
+    switch(format){
+        case CAPTURE_RAW:
+        case CAPTURE_Y4M:
+            if(path[0] == '|'){
+                capture->file = popen(path + 1, PIPE_MODE);
+                capture->pipe = true;
+            }
+            else{
+                capture->file = fopen(path, "wb");
+            }
+            opened = capture->file != NULL;
+            if(opened && format == CAPTURE_Y4M)
+                fputs(Y4M_HEADER, capture->file);
+            break;
+        case CAPTURE_PNG:
+            capture->path = malloc(strlen(path) + 1);
+            if(capture->path != NULL)
+                strcpy(capture->path, path);
+            opened = capture->path != NULL;
+            break;
+        case CAPTURE_SHM:
+            opened = OpenShm(capture, path);
+            break;
+    }
+    if(!opened){
+        printf("Unable to open %s for capture.\n", path);
+        Capture_Destroy(capture);
+        return NULL;
+    }
+    // Frames go straight into shared memory, so there's no writer
+    if(format == CAPTURE_SHM)
+        return capture;
+    capture->wake = SDL_CreateSemaphore(0);
+    if(capture->wake != NULL)
+        capture->writer = SDL_CreateThread(Writer, "capture", capture);
+    if(capture->writer == NULL){
+        printf("Unable to start the capture thread.\n");
+        Capture_Destroy(capture);
+        return NULL;
+    }
+    return capture;
+}
+
+void Capture_Destroy(CAPTURE *c){
+    if(c != NULL){
+        if(c->writer != NULL){
+            // The writer finishes what's queued before it stops
+            SDL_AtomicSet(&c->quit, 1);
+            SDL_SemPost(c->wake);
+            SDL_WaitThread(c->writer, NULL);
+        }
+        if(c->wake != NULL)
+            SDL_DestroySemaphore(c->wake);
+        if(c->file != NULL){
+            if(c->pipe)
+                pclose(c->file);
+            else
+                fclose(c->file);
+        }
+        if(c->dropped > 0)
+            printf("Capture dropped %u of %u frames.\n", c->dropped, c->frames);
+        CloseShm(c);
+        free(c->path);
+        free(c);
+    }
+}
+
+/**
+ * Every pixel is one of the 4 colors unless the color scheme changed while
+ * the frame was on its way here. Those pixels get the shade that's closest
+ * in brightness.
+ */
+static BYTE ShadeOf(unsigned int color, const unsigned int colors[4]){
+    for(int shade = 0; shade < 4; shade++){
+        if(color == colors[shade])
+            return shade;
+    }
+    // 0xRRGGBBAA, so the channels are bytes 3 to 1
+    int luma = ((color >> 24) * 77 + ((color >> 16) & 0xFF) * 150 + ((color >> 8) & 0xFF) * 29) >> 8;
+    int best = 0, best_distance = 256;
+    for(int shade = 0; shade < 4; shade++){
+        unsigned int c = colors[shade];
+        int distance = abs(luma - (int) (((c >> 24) * 77 + ((c >> 16) & 0xFF) * 150 + ((c >> 8) & 0xFF) * 29) >> 8));
+        if(distance < best_distance){
+            best = shade;
+            best_distance = distance;
+        }
+    }
+    return best;
+}
+
+void Capture_Frame(CAPTURE *c, PIXEL frame[SCREEN_HEIGHT][SCREEN_WIDTH], const unsigned int colors[4]){
+    unsigned int number = c->frames++;
+    if(c->format == CAPTURE_SHM){
+        WriteShm(c, frame);
+        return;
+    }
+
+    int head = SDL_AtomicGet(&c->head);
+    if(head - SDL_AtomicGet(&c->tail) >= CAPTURE_QUEUE_SIZE){
+        c->dropped++;
+        return;
+    }
+    BYTE *shades = c->queue[head % CAPTURE_QUEUE_SIZE].shades;
+    for(int y = 0; y < SCREEN_HEIGHT; y++){
+        for(int x = 0; x < SCREEN_WIDTH; x += 4){
+            *shades++ = (ShadeOf(frame[y][x].color, colors) << 6) | (ShadeOf(frame[y][x + 1].color, colors) << 4) |
+                        (ShadeOf(frame[y][x + 2].color, colors) << 2) | ShadeOf(frame[y][x + 3].color, colors);
+        }
+    }
+    memcpy(c->queue[head % CAPTURE_QUEUE_SIZE].colors, colors, sizeof(c->queue[0].colors));
+    c->queue[head % CAPTURE_QUEUE_SIZE].number = number;
+    // The frame has to be all there before the writer can see it
+    SDL_AtomicSet(&c->head, head + 1);
+    SDL_SemPost(c->wake);
+}
+
+static inline BYTE ShadeAt(const BYTE *shades, int pixel){
+    return (shades[pixel / 4] >> (6 - (pixel % 4) * 2)) & 0x03;
+}
+
+static void WriteY4M(FILE *file, const BYTE *shades, const unsigned int colors[4]){
+    // BT.601 limited range, worked out for the 4 colors once
+    BYTE planes[3][4];
+    for(int shade = 0; shade < 4; shade++){
+        int r = colors[shade] >> 24, g = (colors[shade] >> 16) & 0xFF, b = (colors[shade] >> 8) & 0xFF;
+        planes[0][shade] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+        planes[1][shade] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        planes[2][shade] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+    static BYTE plane[SCREEN_WIDTH * SCREEN_HEIGHT];
+    fputs("FRAME\n", file);
+    for(int p = 0; p < 3; p++){
+        for(int pixel = 0; pixel < SCREEN_WIDTH * SCREEN_HEIGHT; pixel++){
+            plane[pixel] = planes[p][ShadeAt(shades, pixel)];
+        }
+        fwrite(plane, 1, sizeof(plane), file);
+    }
+}
+
+static uint32_t CRC32(uint32_t crc, const BYTE *data, size_t length){
+    static uint32_t table[256];
+    if(table[1] == 0){
+        for(uint32_t n = 0; n < 256; n++){
+            uint32_t c = n;
+            for(int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+    }
+    crc = ~crc;
+    for(size_t i = 0; i < length; i++)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void PutBE32(BYTE *out, uint32_t value){
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static void WriteChunk(FILE *file, const char *type, const BYTE *data, uint32_t length){
+    BYTE header[8];
+    PutBE32(header, length);
+    memcpy(header + 4, type, 4);
+    uint32_t crc = CRC32(CRC32(0, header + 4, 4), data, length);
+    BYTE footer[4];
+    PutBE32(footer, crc);
+    fwrite(header, 1, sizeof(header), file);
+    fwrite(data, 1, length, file);
+    fwrite(footer, 1, sizeof(footer), file);
+}
+
+/**
+ * The packed shades are already what a 2 bit indexed PNG holds, so each row
+ * just needs a filter byte in front. The image is small enough to go in a
+ * single uncompressed deflate block.
+ */
+static void WritePNG(const char *path, const BYTE *shades, const unsigned int colors[4]){
+    static const BYTE signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    FILE *file = fopen(path, "wb");
+    if(file == NULL)
+        return;
+    fwrite(signature, 1, sizeof(signature), file);
+
+    BYTE ihdr[13];
+    PutBE32(ihdr, SCREEN_WIDTH);
+    PutBE32(ihdr + 4, SCREEN_HEIGHT);
+    ihdr[8] = 2;  // Bit depth
+    ihdr[9] = 3;  // Indexed color
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    WriteChunk(file, "IHDR", ihdr, sizeof(ihdr));
+
+    BYTE plte[12];
+    for(int shade = 0; shade < 4; shade++){
+        plte[shade * 3] = colors[shade] >> 24;
+        plte[shade * 3 + 1] = colors[shade] >> 16;
+        plte[shade * 3 + 2] = colors[shade] >> 8;
+    }
+    WriteChunk(file, "PLTE", plte, sizeof(plte));
+
+    // zlib header, stored block header, rows, Adler-32
+    enum{ RAW_SIZE = SCREEN_HEIGHT * (1 + PNG_ROW_BYTES) };
+    static BYTE idat[2 + 5 + RAW_SIZE + 4];
+    BYTE *raw = idat + 7;
+    idat[0] = 0x78;
+    idat[1] = 0x01;
+    idat[2] = 0x01; // Last block, stored
+    idat[3] = RAW_SIZE & 0xFF;
+    idat[4] = RAW_SIZE >> 8;
+    idat[5] = ~RAW_SIZE & 0xFF;
+    idat[6] = (~RAW_SIZE >> 8) & 0xFF;
+    for(int y = 0; y < SCREEN_HEIGHT; y++){
+        raw[y * (1 + PNG_ROW_BYTES)] = 0; // No filter
+        memcpy(raw + y * (1 + PNG_ROW_BYTES) + 1, shades + y * PNG_ROW_BYTES, PNG_ROW_BYTES);
+    }
+    uint32_t a = 1, b = 0;
+    for(int i = 0; i < RAW_SIZE; i++){
+        a = (a + raw[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    PutBE32(raw + RAW_SIZE, (b << 16) | a);
+    WriteChunk(file, "IDAT", idat, sizeof(idat));
+    WriteChunk(file, "IEND", NULL, 0);
+    fclose(file);
+}
+
+static int Writer(void *data){
+    CAPTURE *c = data;
+    char path[512];
+    while(true){
+        // One post per queued frame, and one more to stop
+        SDL_SemWait(c->wake);
+        int tail = SDL_AtomicGet(&c->tail);
+        if(tail == SDL_AtomicGet(&c->head)){
+            if(SDL_AtomicGet(&c->quit))
+                break;
+            continue;
+        }
+        const BYTE *shades = c->queue[tail % CAPTURE_QUEUE_SIZE].shades;
+        const unsigned int *colors = c->queue[tail % CAPTURE_QUEUE_SIZE].colors;
+        switch(c->format){
+            case CAPTURE_RAW:
+                fwrite(shades, 1, CAPTURE_FRAME_BYTES, c->file);
+                break;
+            case CAPTURE_Y4M:
+                WriteY4M(c->file, shades, colors);
+                break;
+            case CAPTURE_PNG:
+                snprintf(path, sizeof(path), c->path, c->queue[tail % CAPTURE_QUEUE_SIZE].number);
+                WritePNG(path, shades, colors);
+                break;
+            case CAPTURE_SHM:
+                break;
+        }
+        SDL_AtomicSet(&c->tail, tail + 1);
+    }
+    return 0;
+}
+
+#ifndef _WIN32
+static bool OpenShm(CAPTURE *c, const char *name){
+    struct capture_shm *shm = malloc(sizeof(struct capture_shm));
+    if(shm == NULL)
+        return false;
+    memset(shm, 0, sizeof(struct capture_shm));
+    c->shm = shm;
+    shm->name = malloc(strlen(name) + 1);
+    if(shm->name == NULL)
+        return false;
+    strcpy(shm->name, name);
+
+    shm->size = sizeof(CAPTURE_SHM_HEADER) + CAPTURE_SHM_SLOTS * sizeof(shm->slots[0]);
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+    if(fd < 0)
+        return false;
+    void *memory = MAP_FAILED;
+    if(ftruncate(fd, shm->size) == 0)
+        memory = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(memory == MAP_FAILED){
+        shm_unlink(name);
+        return false;
+    }
+
+    shm->header = memory;
+    shm->slots = (void *) ((BYTE *) memory + sizeof(CAPTURE_SHM_HEADER));
+    memset(shm->header, 0, sizeof(CAPTURE_SHM_HEADER));
+    shm->header->width = SCREEN_WIDTH;
+    shm->header->height = SCREEN_HEIGHT;
+    shm->header->slot_count = CAPTURE_SHM_SLOTS;
+    shm->header->slot_size = sizeof(shm->slots[0]);
+    // The magic goes in last, so a reader never sees a half filled in header
+    SDL_AtomicSet(&shm->header->head, 0);
+    memcpy(shm->header->magic, "GBEMUCAP", 8);
+    return true;
+}
+
+static void CloseShm(CAPTURE *c){
+    struct capture_shm *shm = c->shm;
+    if(shm != NULL){
+        if(shm->header != NULL){
+            munmap(shm->header, shm->size);
+            shm_unlink(shm->name);
+        }
+        free(shm->name);
+        free(shm);
+        c->shm = NULL;
+    }
+}
+
+static void WriteShm(CAPTURE *c, PIXEL frame[SCREEN_HEIGHT][SCREEN_WIDTH]){
+    CAPTURE_SHM_HEADER *header = c->shm->header;
+    int head = SDL_AtomicGet(&header->head);
+    if(head - SDL_AtomicGet(&header->tail) >= CAPTURE_SHM_SLOTS){
+        c->dropped++;
+        return;
+    }
+    memcpy(c->shm->slots[head % CAPTURE_SHM_SLOTS], frame, sizeof(c->shm->slots[0]));
+    SDL_AtomicSet(&header->head, head + 1);
+}
+#else
+// There's no POSIX shared memory to hand frames over with
+static bool OpenShm(CAPTURE *c, const char *name){
+    return false;
+}
+
+static void CloseShm(CAPTURE *c){
+    free(c->shm);
+    c->shm = NULL;
+}
+
+static void WriteShm(CAPTURE *c, PIXEL frame[SCREEN_HEIGHT][SCREEN_WIDTH]){
+}
+#endif // _WIN32
@@ -3,6 +3,16 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#ifdef PROFILE
+#include "profiler.h"
+#endif // PROFILE
+
+// The debugger steps and the profiler counts individual instructions,
+// so neither of them should ever see a fused sequence
+#if defined(DEBUG) || defined(PROFILE)
+#undef CPU_FUSION
+#endif
+
 #define CYCLES(n) 4 * n
 
 
@@ -20,7 +30,9 @@ void CPU_Startup(CPU *c){
         c->de.reg = 0x00D8;
         c->hl.reg = 0x014D;
         c->IME = false;
+        c->ei_delay = false;
         c->halt = false;
+        c->halt_bug = false;
         c->stop = false;
     }
 }
@@ -326,12 +338,105 @@ static inline void res(CPU *c, BYTE *r, int b){
     (*r) &= ~(0x01 << b);
 }
 
+#ifdef CPU_FUSION
+/**
+ * Superinstructions
+ *
+ * Each of these is called at the end of the first instruction of a common
+ * sequence and, if the following opcodes complete the sequence, executes them
+ * in the same dispatch. Every fused instruction still goes through FETCH-style
+ * cycle accounting, so c->cycles ends up as the sum of the individual
+ * instructions. The only observable difference is that the timer, PPU and APU
+ * see one longer instruction instead of several short ones.
+ *
+ * The fused set was chosen from the opcode pair histogram produced by the
+ * profiling build (see profiler.h).
+ */
+
+// Look at an upcoming opcode without spending any cycles on it
+static inline BYTE PEEK(CPU *c, WORD offset){
+    return Mem_ReadByte(c->memory, c->pc + offset);
+}
+
+// Consume an opcode that was already checked with PEEK
+static inline void SKIP(CPU *c, BYTE opcode){
+    c->ir = opcode;
+    c->pc++;
+    c->cycles += CYCLES(1);
+}
+
+// JR NZ,r8 / JR Z,r8 following an instruction that just set the Z flag
+static inline void fuse_jr(CPU *c){
+    BYTE next = PEEK(c, 0);
+    if(next == 0x20 || next == 0x28){
+        SKIP(c, next);
+        if(CPU_CheckFlag(c, Z_FLAG) == (next == 0x28))
+            jr_e(c);
+        else
+            PC_WRITE(c, c->pc + 1);
+    }
+}
+
+// LDI A,(HL) -> LD (DE),A -> INC DE (-> DEC B/C -> JR NZ)
+static inline void fuse_copy(CPU *c){
+    // Stay away from IO and IE so the write can't raise an interrupt mid-sequence
+    if(PEEK(c, 0) == 0x12 && PEEK(c, 1) == 0x13 && c->de.reg < 0xFF00){
+        SKIP(c, 0x12);
+        WRITE(c, c->de.reg, c->af.hi);
+        SKIP(c, 0x13);
+        inc_r16(c, &c->de.reg);
+        switch(PEEK(c, 0)){
+            case 0x05:
+                SKIP(c, 0x05);
+                dec_r8(c, &c->bc.hi);
+                fuse_jr(c);
+                break;
+            case 0x0D:
+                SKIP(c, 0x0D);
+                dec_r8(c, &c->bc.lo);
+                fuse_jr(c);
+                break;
+        };
+    }
+}
+
+// LDH A,($FF00 + n) -> CP n -> JR NZ/Z (polling LY, STAT, P1, ...)
+static inline void fuse_poll(CPU *c){
+    if(PEEK(c, 0) == 0xFE){
+        SKIP(c, 0xFE);
+        cp_a(c, FETCH(c));
+        fuse_jr(c);
+    }
+}
+
+// LD A,B -> OR C -> JR NZ (16-bit loop counter test)
+static inline void fuse_test_bc(CPU *c){
+    if(PEEK(c, 0) == 0xB1){
+        SKIP(c, 0xB1);
+        or_a(c, c->bc.lo);
+        fuse_jr(c);
+    }
+}
+#define FUSE(handler) handler(c)
+#else
+#define FUSE(handler)
+#endif // CPU_FUSION
+
 
 void CPU_EmulateCycle(CPU *c){
     BYTE temp8; // temporary variable that's used by some instructions
     WORD temp16;
+#ifdef PROFILE
+    WORD opcode_pc = c->pc;
+#endif // PROFILE
     c->cycles = 0;
     c->ir = FETCH(c);
+    // After the HALT bug, PC doesn't move past the opcode the first time
+    c->pc -= c->halt_bug;
+    c->halt_bug = false;
+#ifdef PROFILE
+    BYTE opcode = c->ir; // c->ir gets replaced by the second byte of CB instructions
+#endif // PROFILE
     switch(c->ir){
         case 0x00: // NOP
             break;
@@ -349,6 +454,7 @@ void CPU_EmulateCycle(CPU *c){
             break;
         case 0x05:
             dec_r8(c, &c->bc.hi);
+            FUSE(fuse_jr);
             break;
         case 0x06:
             c->bc.hi = FETCH(c);
@@ -377,6 +483,7 @@ void CPU_EmulateCycle(CPU *c){
             break;
         case 0x0D:
             dec_r8(c, &c->bc.lo);
+            FUSE(fuse_jr);
             break;
         case 0x0E:
             c->bc.lo = FETCH(c);
@@ -406,6 +513,7 @@ void CPU_EmulateCycle(CPU *c){
             break;
         case 0x15:
             dec_r8(c, &c->de.hi);
+            FUSE(fuse_jr);
             break;
         case 0x16:
             c->de.hi = FETCH(c);
@@ -433,6 +541,7 @@ void CPU_EmulateCycle(CPU *c){
             break;
         case 0x1D:
             dec_r8(c, &c->de.lo);
+            FUSE(fuse_jr);
             break;
         case 0x1E:
             c->de.lo = FETCH(c);
@@ -464,6 +573,7 @@ void CPU_EmulateCycle(CPU *c){
             break;
         case 0x25:
             dec_r8(c, &c->hl.hi);
+            FUSE(fuse_jr);
             break;
         case 0x26:
             c->hl.hi = FETCH(c);
@@ -502,6 +612,7 @@ void CPU_EmulateCycle(CPU *c){
             break;
         case 0x2A: // LDI A,(HL)
             c->af.hi = READ(c, c->hl.reg++);
+            FUSE(fuse_copy);
             break;
         case 0x2B:
             dec_r16(c, &c->hl.reg);
@@ -511,6 +622,7 @@ void CPU_EmulateCycle(CPU *c){
             break;
         case 0x2D:
             dec_r8(c, &c->hl.lo);
+            FUSE(fuse_jr);
             break;
         case 0x2E:
             c->hl.lo = FETCH(c);
@@ -576,6 +688,7 @@ void CPU_EmulateCycle(CPU *c){
             break;
         case 0x3D:
             dec_r8(c, &c->af.hi);
+            FUSE(fuse_jr);
             break;
         case 0x3E:
             c->af.hi = FETCH(c);
@@ -645,10 +758,17 @@ void CPU_EmulateCycle(CPU *c){
         case 0x73: WRITE(c, c->hl.reg, c->de.lo); break;
         case 0x74: WRITE(c, c->hl.reg, c->hl.hi); break;
         case 0x75: WRITE(c, c->hl.reg, c->hl.lo); break;
-        case 0x76: c->halt = true; break; // HALT replaces LD (HL),(HL)
+        case 0x76: // HALT replaces LD (HL),(HL)
+            // With an interrupt already pending and IME off, HALT doesn't
+            // wait for it, and fails to move past the next byte instead
+            if(!c->IME && c->memory->pending != 0)
+                c->halt_bug = true;
+            else
+                c->halt = true;
+            break;
         case 0x77: WRITE(c, c->hl.reg, c->af.hi); break;
 
-        case 0x78: c->af.hi = c->bc.hi; break;
+        case 0x78: c->af.hi = c->bc.hi; FUSE(fuse_test_bc); break;
         case 0x79: c->af.hi = c->bc.lo; break;
         case 0x7A: c->af.hi = c->de.hi; break;
         case 0x7B: c->af.hi = c->de.lo; break;
@@ -1215,6 +1335,7 @@ void CPU_EmulateCycle(CPU *c){
             break;
         case 0xF0: // LDH A,($FF00 + n)
             c->af.hi = READ(c, 0xFF00 + FETCH(c));
+            FUSE(fuse_poll);
             break;
         case 0xF1:
             pop(c, &c->af);
@@ -1225,6 +1346,7 @@ void CPU_EmulateCycle(CPU *c){
             break;
         case 0xF3: // DI
             c->IME = false;
+            c->ei_delay = false;
             break;
         case 0xF4: // Unused
             break;
@@ -1251,7 +1373,9 @@ void CPU_EmulateCycle(CPU *c){
             c->af.hi = READ(c, imm16(c));
             break;
         case 0xFB: // EI
-            c->IME = true;
+            // Interrupt_Handle turns IME on after the next instruction
+            if(!c->IME)
+                c->ei_delay = true;
             break;
         case 0xFC: // Unused
         case 0xFD: // Unused
@@ -1263,4 +1387,7 @@ void CPU_EmulateCycle(CPU *c){
             rst(c, 0x38);
             break;
     };
+#ifdef PROFILE
+    Profiler_RecordInstruction(c, opcode_pc, opcode);
+#endif // PROFILE
 }
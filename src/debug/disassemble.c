@@ -1,6 +1,8 @@
 #include "disassemble.h"
 
-#ifdef DEBUG
+#if defined(DEBUG) || defined(PROFILE)
+
+#include <stdio.h>
 
 static const char *instructions[] = 
 {
@@ -22,8 +24,31 @@ static const char *instructions[] =
     "LD A, (0xFF00 + n)", "POP AF", "LD A, (0xFF00 + C)", "DI", "UNKNOWN", "PUSH AF", "OR n", "RST 0x30", "LD HL, SP+n", "LD SP, HL", "LD A, (nn)", "EI", "UNKNOWN", "UNKNOWN", "CP n", "RST 0x38"
 };
 
+// CB prefixed instructions follow a regular pattern, so their names are built on first use
+static const char *cb_operations[] = { "RLC", "RRC", "RL", "RR", "SLA", "SRA", "SWAP", "SRL" };
+static const char *cb_bit_operations[] = { "BIT", "RES", "SET" };
+static const char *cb_registers[] = { "B", "C", "D", "E", "H", "L", "(HL)", "A" };
+static char cb_instructions[256][16];
+
 const char *Disassemble_Instruction(CPU *c){
     return instructions[c->ir];
 }
 
-#endif // DEBUG
\ No newline at end of file
+const char *Disassemble_Opcode(BYTE opcode){
+    return instructions[opcode];
+}
+
+const char *Disassemble_CBOpcode(BYTE opcode){
+    if(cb_instructions[opcode][0] == '\0'){
+        if(opcode < 0x40){
+            snprintf(cb_instructions[opcode], 16, "%s %s", cb_operations[opcode >> 3], cb_registers[opcode & 0x07]);
+        }
+        else{
+            snprintf(cb_instructions[opcode], 16, "%s %d, %s", cb_bit_operations[(opcode >> 6) - 1],
+                     (opcode >> 3) & 0x07, cb_registers[opcode & 0x07]);
+        }
+    }
+    return cb_instructions[opcode];
+}
+
+#endif // DEBUG || PROFILE
\ No newline at end of file
@@ -91,7 +91,6 @@ void Start_Debugger(GAMEBOY *gb){
     int counter = 0;
     bool cont = false;
     bool restart = false;
-    uint32_t total_cycles = 0;
     uint32_t cycles;
     uint64_t instructions_executed = 0;
     SDL_Event event;
@@ -114,8 +113,8 @@ void Start_Debugger(GAMEBOY *gb){
                     break;
             };
         }
-        total_cycles = 0;
-        while(total_cycles < CYCLES_PER_UPDATE){
+        gb->frame_cycles = 0;
+        while(gb->frame_cycles < CYCLES_PER_UPDATE){
             if(!gb->cpu->stop){
                 CPU_Fetch(gb->cpu);
 
@@ -137,25 +136,27 @@ void Start_Debugger(GAMEBOY *gb){
                 if(!gb->cpu->halt){
                     CPU_DecodeExecute(gb->cpu);
                     cycles = CPU_GetCycles(gb->cpu);
-                    total_cycles += cycles;
+                    gb->frame_cycles += cycles;
                     instructions_executed++;
-                    APU_Update(gb->apu, (int) cycles);
                 }
                 else{
                     cycles = 4;
-                    total_cycles += 4;
+                    gb->frame_cycles += 4;
                 } // endif halt
-                Timer_Update(gb->timer, cycles);
+                if(gb->frame_cycles >= gb->timer->overflow)
+                    Timer_CatchUp(gb->timer);
                 Graphics_Update(gb->graphics, cycles);
             }
             else{
                 cycles = 4;
-                total_cycles += 4;
+                gb->frame_cycles += 4;
             } // endif stop
             Interrupt_Handle(gb->cpu);
         }
+        Timer_EndFrame(gb->timer);
+        APU_EndFrame(gb->apu);
         Graphics_RenderScreen(gb->graphics);
-        if(total_cycles < CYCLES_PER_UPDATE){
+        if(gb->frame_cycles < CYCLES_PER_UPDATE){
             break;
         }
         //SDL_Delay(30);
@@ -0,0 +1,461 @@
+#include "profiler.h"
+
+#ifdef PROFILE
+
+#include "disassemble.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+
+#define MAX_STACK_DEPTH     64
+#define MAX_STACKS        8192 // Distinct call stacks, must be a power of 2
+#define MAX_SYMBOL_LENGTH   64
+
+// Guest code locations are stored as (bank << 16) | address
+#define LOCATION(bank, addr)  (((uint32_t) (bank) << 16) | (addr))
+#define LOCATION_BANK(loc)    ((loc) >> 16)
+#define LOCATION_ADDR(loc)    ((loc) & 0xFFFF)
+#define LOCATION_HALT         0xFFFFFFFF
+
+typedef struct{
+    uint64_t executions;
+    uint64_t cycles;
+} PROFILE_COUNTER;
+
+typedef struct{
+    BYTE first;
+    BYTE second;
+    uint64_t count;
+} OPCODE_PAIR;
+
+// Code executing outside of cartridge ROM
+typedef enum{
+    RAM_VRAM,
+    RAM_SRAM,
+    RAM_WRAM,
+    RAM_HRAM,
+    RAM_OTHER,
+    RAM_REGION_COUNT
+} RAM_REGION;
+
+static const char *ram_region_names[RAM_REGION_COUNT] = { "VRAM", "SRAM", "WRAM", "HRAM", "OTHER" };
+
+typedef struct{
+    uint32_t location;
+    char name[MAX_SYMBOL_LENGTH];
+} SYMBOL;
+
+typedef struct{
+    uint32_t location; // Entry point of the called routine
+    WORD sp;           // SP right after the return address was pushed
+} CALL_FRAME;
+
+typedef struct{
+    uint64_t samples;
+    int depth;
+    uint32_t frames[MAX_STACK_DEPTH + 1]; // Outermost call first, leaf last
+} STACK_SAMPLE;
+
+static PROFILE_COUNTER opcodes[256];
+static PROFILE_COUNTER cb_opcodes[256];
+static PROFILE_COUNTER rom_banks[256];
+static PROFILE_COUNTER ram_regions[RAM_REGION_COUNT];
+static uint64_t halt_cycles;
+
+// opcode_pairs[a][b] counts how many times opcode b was executed right after a
+static uint64_t opcode_pairs[256][256];
+static int last_opcode = -1;
+
+static SYMBOL *symbols;
+static int symbol_count;
+
+static CALL_FRAME call_stack[MAX_STACK_DEPTH];
+static int call_depth;
+
+static STACK_SAMPLE stacks[MAX_STACKS];
+static uint64_t dropped_samples; // Samples that didn't fit in the stack table
+static unsigned int sample_period = PROFILER_SAMPLE_PERIOD;
+static unsigned int sample_timer;
+
+static volatile sig_atomic_t dump_requested = 0;
+
+static void Dump_Signal(int sig){
+    dump_requested = 1;
+    signal(sig, Dump_Signal);
+}
+
+void Profiler_Init(){
+    char *period = getenv("GBEMU_SAMPLE_PERIOD");
+    if(period != NULL && atoi(period) > 0)
+        sample_period = atoi(period);
+    atexit(Profiler_Dump);
+#ifdef SIGUSR1
+    signal(SIGUSR1, Dump_Signal);
+#endif // SIGUSR1
+#ifdef SIGBREAK
+    signal(SIGBREAK, Dump_Signal);
+#endif // SIGBREAK
+}
+
+static int Compare_Symbols(const void *a, const void *b){
+    uint32_t loc_a = ((const SYMBOL *) a)->location;
+    uint32_t loc_b = ((const SYMBOL *) b)->location;
+    return (loc_a > loc_b) - (loc_a < loc_b);
+}
+
+void Profiler_LoadSymbols(const char *rom_file){
+    char filename[256];
+    char line[256];
+    char name[MAX_SYMBOL_LENGTH];
+    unsigned int bank, addr;
+    int capacity = 0;
+
+    // game.gb -> game.sym
+    strncpy(filename, rom_file, sizeof(filename) - 5);
+    filename[sizeof(filename) - 5] = '\0';
+    char *ext = strrchr(filename, '.');
+    if(ext == NULL || strchr(ext, '/') != NULL || strchr(ext, '\\') != NULL)
+        ext = filename + strlen(filename);
+    strcpy(ext, ".sym");
+
+    FILE *fp = fopen(filename, "r");
+    if(fp == NULL)
+        return;
+    while(fgets(line, sizeof(line), fp) != NULL){
+        // Lines look like "BB:AAAA Label". Everything after a ';' is a comment
+        if(sscanf(line, "%x:%x %63s", &bank, &addr, name) != 3 || name[0] == ';')
+            continue;
+        // Local labels (Function.loop) are lumped in with the function they belong to
+        if(strchr(name, '.') != NULL)
+            continue;
+        if(symbol_count == capacity){
+            capacity = (capacity == 0) ? 1024 : capacity * 2;
+            SYMBOL *grown = realloc(symbols, sizeof(SYMBOL) * capacity);
+            if(grown == NULL)
+                break;
+            symbols = grown;
+        }
+        symbols[symbol_count].location = LOCATION(bank & 0xFF, addr & 0xFFFF);
+        strcpy(symbols[symbol_count].name, name);
+        symbol_count++;
+    }
+    fclose(fp);
+    qsort(symbols, symbol_count, sizeof(SYMBOL), Compare_Symbols);
+    printf("Loaded %d symbols from %s\n", symbol_count, filename);
+}
+
+// Returns the last symbol at or before location in the same bank, or NULL
+static const SYMBOL *Find_Symbol(uint32_t location){
+    int lo = 0, hi = symbol_count - 1;
+    const SYMBOL *found = NULL;
+    while(lo <= hi){
+        int mid = (lo + hi) / 2;
+        if(symbols[mid].location <= location){
+            found = &symbols[mid];
+            lo = mid + 1;
+        }
+        else{
+            hi = mid - 1;
+        }
+    }
+    if(found != NULL && LOCATION_BANK(found->location) != LOCATION_BANK(location))
+        found = NULL;
+    return found;
+}
+
+// Samples are keyed by symbol so every address inside a routine is counted together
+static uint32_t Resolve_Location(uint32_t location){
+    const SYMBOL *symbol = Find_Symbol(location);
+    return (symbol != NULL) ? symbol->location : location;
+}
+
+static uint32_t Get_Location(CPU *c, WORD addr){
+    if(Mem_GetRegion(c->memory, addr) == ROMX)
+        return LOCATION(c->memory->cartridge->current_rom_bank, addr);
+    return LOCATION(0, addr);
+}
+
+static void Push_Frame(CPU *c){
+    if(call_depth < MAX_STACK_DEPTH){
+        call_stack[call_depth].location = Get_Location(c, c->pc);
+        call_stack[call_depth].sp = c->sp;
+        call_depth++;
+    }
+}
+
+// Drops every frame whose return address is no longer on the guest stack. This
+// handles RET as well as code that discards return addresses by hand.
+static void Unwind_Frames(CPU *c){
+    while(call_depth > 0 && call_stack[call_depth - 1].sp < c->sp)
+        call_depth--;
+}
+
+static void Take_Sample(CPU *c, bool halted){
+    uint32_t frames[MAX_STACK_DEPTH + 1];
+    int depth = 0;
+    uint32_t hash = 2166136261u;
+
+    Unwind_Frames(c);
+    for(int i = 0; i < call_depth; i++)
+        frames[depth++] = Resolve_Location(call_stack[i].location);
+    if(halted){
+        frames[depth++] = LOCATION_HALT;
+    }
+    else if(symbol_count > 0){
+        // The call stack already ends in the current routine, only add a leaf
+        // when the PC is under a different label (tail jumps, global loop labels)
+        const SYMBOL *leaf = Find_Symbol(Get_Location(c, c->pc));
+        if(leaf != NULL && (depth == 0 || frames[depth - 1] != leaf->location))
+            frames[depth++] = leaf->location;
+    }
+
+    for(int i = 0; i < depth; i++){
+        hash = (hash ^ frames[i]) * 16777619u;
+    }
+    for(int probe = 0; probe < MAX_STACKS; probe++){
+        STACK_SAMPLE *entry = &stacks[(hash + probe) & (MAX_STACKS - 1)];
+        if(entry->samples == 0){
+            entry->depth = depth;
+            memcpy(entry->frames, frames, sizeof(uint32_t) * depth);
+        }
+        else if(entry->depth != depth || memcmp(entry->frames, frames, sizeof(uint32_t) * depth) != 0){
+            continue;
+        }
+        entry->samples++;
+        return;
+    }
+    dropped_samples++;
+}
+
+static void Advance_Sample_Timer(CPU *c, unsigned int cycles, bool halted){
+    sample_timer += cycles;
+    if(sample_timer >= sample_period){
+        sample_timer -= sample_period;
+        Take_Sample(c, halted);
+    }
+}
+
+static PROFILE_COUNTER *Get_Bank_Counter(CPU *c, WORD pc){
+    switch(Mem_GetRegion(c->memory, pc)){
+        case ROM0:
+            return &rom_banks[0];
+        case ROMX:
+            return &rom_banks[c->memory->cartridge->current_rom_bank];
+        case VRAM:
+            return &ram_regions[RAM_VRAM];
+        case SRAM:
+            return &ram_regions[RAM_SRAM];
+        case WRAM0:
+        case WRAMX:
+        case ECHO:
+            return &ram_regions[RAM_WRAM];
+        case HRAM:
+            return &ram_regions[RAM_HRAM];
+        default:
+            return &ram_regions[RAM_OTHER];
+    };
+}
+
+void Profiler_RecordInstruction(CPU *c, WORD pc, BYTE opcode){
+    PROFILE_COUNTER *bank = Get_Bank_Counter(c, pc);
+    opcodes[opcode].executions++;
+    opcodes[opcode].cycles += c->cycles;
+    if(opcode == 0xCB){
+        cb_opcodes[c->ir].executions++;
+        cb_opcodes[c->ir].cycles += c->cycles;
+    }
+    bank->executions++;
+    bank->cycles += c->cycles;
+
+    if(last_opcode >= 0)
+        opcode_pairs[last_opcode][opcode]++;
+    last_opcode = opcode;
+
+    switch(opcode){
+        case 0xC4: // CALL cc,nn
+        case 0xCC:
+        case 0xD4:
+        case 0xDC:
+            if(c->pc == (WORD) (pc + 3))
+                break; // Not taken
+            // Fall through
+        case 0xCD: // CALL nn
+        case 0xC7: // RST
+        case 0xCF:
+        case 0xD7:
+        case 0xDF:
+        case 0xE7:
+        case 0xEF:
+        case 0xF7:
+        case 0xFF:
+            Push_Frame(c);
+            break;
+        case 0xC0: // RET cc
+        case 0xC8:
+        case 0xD0:
+        case 0xD8:
+        case 0xC9: // RET
+        case 0xD9: // RETI
+            Unwind_Frames(c);
+            break;
+    };
+    Advance_Sample_Timer(c, c->cycles, false);
+}
+
+void Profiler_RecordHalt(CPU *c, unsigned int cycles){
+    halt_cycles += cycles;
+    Advance_Sample_Timer(c, cycles, true);
+}
+
+void Profiler_RecordInterrupt(CPU *c){
+    Push_Frame(c);
+    // The service routine doesn't follow the interrupted instruction
+    last_opcode = -1;
+}
+
+void Profiler_Update(){
+    if(dump_requested){
+        dump_requested = 0;
+        Profiler_Dump();
+    }
+}
+
+static uint64_t Total_Cycles(){
+    uint64_t total = halt_cycles;
+    for(int i = 0; i < 256; i++)
+        total += opcodes[i].cycles;
+    return total;
+}
+
+static double Percent(uint64_t part, uint64_t total){
+    return (total == 0) ? 0.0 : (100.0 * part) / total;
+}
+
+static void Dump_Opcodes(uint64_t total){
+    FILE *fp = fopen(PROFILER_OPCODES_FILE, "w");
+    if(fp != NULL){
+        fprintf(fp, "prefix,opcode,disassembly,executions,cycles,percent_cycles\n");
+        for(int i = 0; i < 256; i++){
+            if(opcodes[i].executions != 0){
+                fprintf(fp, ",0x%02X,\"%s\",%" PRIu64 ",%" PRIu64 ",%.4f\n", i, Disassemble_Opcode(i),
+                        opcodes[i].executions, opcodes[i].cycles, Percent(opcodes[i].cycles, total));
+            }
+        }
+        for(int i = 0; i < 256; i++){
+            if(cb_opcodes[i].executions != 0){
+                fprintf(fp, "0xCB,0x%02X,\"%s\",%" PRIu64 ",%" PRIu64 ",%.4f\n", i, Disassemble_CBOpcode(i),
+                        cb_opcodes[i].executions, cb_opcodes[i].cycles, Percent(cb_opcodes[i].cycles, total));
+            }
+        }
+        fprintf(fp, ",,\"HALT (idle)\",,%" PRIu64 ",%.4f\n", halt_cycles, Percent(halt_cycles, total));
+        fclose(fp);
+        printf("Opcode profile written to %s\n", PROFILER_OPCODES_FILE);
+    }
+}
+
+static void Dump_Banks(uint64_t total){
+    FILE *fp = fopen(PROFILER_BANKS_FILE, "w");
+    if(fp != NULL){
+        fprintf(fp, "region,bank,executions,cycles,percent_cycles\n");
+        for(int i = 0; i < 256; i++){
+            if(rom_banks[i].executions != 0){
+                fprintf(fp, "ROM,%d,%" PRIu64 ",%" PRIu64 ",%.4f\n", i,
+                        rom_banks[i].executions, rom_banks[i].cycles, Percent(rom_banks[i].cycles, total));
+            }
+        }
+        for(int i = 0; i < RAM_REGION_COUNT; i++){
+            if(ram_regions[i].executions != 0){
+                fprintf(fp, "%s,,%" PRIu64 ",%" PRIu64 ",%.4f\n", ram_region_names[i],
+                        ram_regions[i].executions, ram_regions[i].cycles, Percent(ram_regions[i].cycles, total));
+            }
+        }
+        fclose(fp);
+        printf("Bank profile written to %s\n", PROFILER_BANKS_FILE);
+    }
+}
+
+static int Compare_Pairs(const void *a, const void *b){
+    uint64_t count_a = ((const OPCODE_PAIR *) a)->count;
+    uint64_t count_b = ((const OPCODE_PAIR *) b)->count;
+    // Descending order
+    return (count_a < count_b) - (count_a > count_b);
+}
+
+static void Dump_Pairs(){
+    OPCODE_PAIR *pairs = malloc(sizeof(OPCODE_PAIR) * 256 * 256);
+    uint64_t total = 0;
+    int n = 0;
+    if(pairs == NULL)
+        return;
+    for(int a = 0; a < 256; a++){
+        for(int b = 0; b < 256; b++){
+            if(opcode_pairs[a][b] != 0){
+                pairs[n].first = a;
+                pairs[n].second = b;
+                pairs[n].count = opcode_pairs[a][b];
+                total += pairs[n].count;
+                n++;
+            }
+        }
+    }
+    qsort(pairs, n, sizeof(OPCODE_PAIR), Compare_Pairs);
+
+    FILE *fp = fopen(PROFILER_PAIRS_FILE, "w");
+    if(fp != NULL){
+        fprintf(fp, "first,second,count,percent,first_disassembly,second_disassembly\n");
+        for(int i = 0; i < n; i++){
+            fprintf(fp, "0x%02X,0x%02X,%" PRIu64 ",%.4f,\"%s\",\"%s\"\n", pairs[i].first, pairs[i].second,
+                    pairs[i].count, Percent(pairs[i].count, total),
+                    Disassemble_Opcode(pairs[i].first), Disassemble_Opcode(pairs[i].second));
+        }
+        fclose(fp);
+        printf("Opcode pairs written to %s\n", PROFILER_PAIRS_FILE);
+    }
+    free(pairs);
+}
+
+static void Print_Location(FILE *fp, uint32_t location){
+    const SYMBOL *symbol;
+    if(location == LOCATION_HALT)
+        fprintf(fp, "[halt]");
+    else if((symbol = Find_Symbol(location)) != NULL)
+        fprintf(fp, "%s", symbol->name);
+    else
+        fprintf(fp, "%02X:%04X", LOCATION_BANK(location), LOCATION_ADDR(location));
+}
+
+static void Dump_Stacks(){
+    FILE *fp = fopen(PROFILER_STACKS_FILE, "w");
+    if(fp != NULL){
+        for(int i = 0; i < MAX_STACKS; i++){
+            if(stacks[i].samples != 0){
+                if(stacks[i].depth == 0)
+                    fprintf(fp, "[top level]");
+                for(int j = 0; j < stacks[i].depth; j++){
+                    if(j != 0)
+                        fputc(';', fp);
+                    Print_Location(fp, stacks[i].frames[j]);
+                }
+                fprintf(fp, " %" PRIu64 "\n", stacks[i].samples);
+            }
+        }
+        if(dropped_samples != 0)
+            fprintf(fp, "[dropped] %" PRIu64 "\n", dropped_samples);
+        fclose(fp);
+        printf("Sampled call stacks written to %s\n", PROFILER_STACKS_FILE);
+    }
+}
+
+void Profiler_Dump(){
+    uint64_t total = Total_Cycles();
+    Dump_Opcodes(total);
+    Dump_Banks(total);
+    Dump_Pairs();
+    Dump_Stacks();
+}
+
+#endif // PROFILE
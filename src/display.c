@@ -1,12 +1,15 @@
 #include "display.h"
+#include "scaler.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 DISPLAY *Display_Create(){
     DISPLAY *display = malloc(sizeof(DISPLAY));
     if(display != NULL){
+        memset(display, 0, sizeof(DISPLAY));
         display->window = SDL_CreateWindow(WINDOW_NAME, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
                                 SCREEN_WIDTH * PIXEL_SIZE, SCREEN_HEIGHT * PIXEL_SIZE, SDL_WINDOW_SHOWN);
         if(display->window == NULL){
@@ -21,6 +24,11 @@ DISPLAY *Display_Create(){
                 Display_Destroy(display);
                 display = NULL;
             }
+            else if(!Display_SetScaler(display, NULL)){
+                printf("Unable to create texture.\n");
+                Display_Destroy(display);
+                display = NULL;
+            }
         }
     }
     return display;
@@ -28,26 +36,59 @@ DISPLAY *Display_Create(){
 
 void Display_Destroy(DISPLAY *d){
     if(d != NULL){
+        if(d->texture != NULL)
+            SDL_DestroyTexture(d->texture);
         SDL_DestroyRenderer(d->renderer);
         SDL_DestroyWindow(d->window);
         free(d);
     }
 }
 
-void Display_RenderScreen(DISPLAY *d, PIXEL frame[SCREEN_WIDTH][SCREEN_HEIGHT]){
-    int i, j;
-    SDL_Rect pixel;
+bool Display_SetScaler(DISPLAY *d, struct scaler *s){
+    int width = (s != NULL) ? s->width : SCREEN_WIDTH;
+    int height = (s != NULL) ? s->height : SCREEN_HEIGHT;
+    if(d->texture != NULL)
+        SDL_DestroyTexture(d->texture);
+    // PIXEL.color is 0xRRGGBBAA, which is what RGBA8888 means to SDL
+    d->texture = SDL_CreateTexture(d->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, width, height);
+    d->scaler = s;
+    d->redraw = true;
+    return d->texture != NULL;
+}
 
-    for(j = 0; j < SCREEN_HEIGHT; j++){
-        for(i = 0; i < SCREEN_WIDTH; i++){
-            SDL_SetRenderDrawColor(d->renderer, frame[i][j].r, frame[i][j].g, frame[i][j].b, frame[i][j].a);
-            pixel.x = i * PIXEL_SIZE;
-            pixel.y = j * PIXEL_SIZE;
-            pixel.w = PIXEL_SIZE;
-            pixel.h = PIXEL_SIZE;
+void Display_RenderScreen(DISPLAY *d, PIXEL frame[SCREEN_HEIGHT][SCREEN_WIDTH], const LINE_MASK *changed){
+    LINE_MASK all, scaled;
+    if(d->redraw){
+        memset(&all, 0xFF, sizeof(LINE_MASK));
+        changed = &all;
+        d->redraw = false;
+    }
 
-            SDL_RenderFillRect(d->renderer, &pixel);
-        }
+    // Frame lines are uploaded as they are, or as the scale rows they became
+    const PIXEL *pixels = frame[0];
+    int width = SCREEN_WIDTH;
+    int scale = 1;
+    if(d->scaler != NULL){
+        Scaler_Scale(d->scaler, frame, changed, &scaled);
+        changed = &scaled;
+        pixels = d->scaler->pixels;
+        width = d->scaler->width;
+        scale = d->scaler->scale;
+    }
+
+    // Upload each run of changed lines with one call
+    SDL_Rect rows = {0, 0, width, 0};
+    for(int j = 0; j < SCREEN_HEIGHT; j++){
+        if(!LINE_MASK_TEST(changed, j))
+            continue;
+        int first = j;
+        while(j < SCREEN_HEIGHT && LINE_MASK_TEST(changed, j))
+            j++;
+        rows.y = first * scale;
+        rows.h = (j - first) * scale;
+        SDL_UpdateTexture(d->texture, &rows, pixels + rows.y * width, width * sizeof(PIXEL));
     }
+    // The renderer scales the texture up to the window
+    SDL_RenderCopy(d->renderer, d->texture, NULL, NULL);
     SDL_RenderPresent(d->renderer);
-}
\ No newline at end of file
+}
@@ -0,0 +1,255 @@
+#include "fifo.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void CheckWindow(PIXEL_FIFO *f, const GRAPHICS *g, const BYTE *io);
+static void StepFetcher(PIXEL_FIFO *f, const GRAPHICS *g, const BYTE *io);
+static void CheckSprites(PIXEL_FIFO *f, const GRAPHICS *g);
+static void FetchSprite(PIXEL_FIFO *f, const GRAPHICS *g);
+static void ShiftPixel(PIXEL_FIFO *f, const GRAPHICS *g);
+
+
+PIXEL_FIFO *Fifo_Create(){
+    PIXEL_FIFO *fifo = malloc(sizeof(PIXEL_FIFO));
+    if(fifo != NULL){
+        memset(fifo, 0, sizeof(PIXEL_FIFO));
+    }
+    return fifo;
+}
+
+void Fifo_Destroy(PIXEL_FIFO *f){
+    if(f != NULL){
+        free(f);
+    }
+}
+
+void Fifo_StartFrame(PIXEL_FIFO *f){
+    f->window_reached = false;
+    f->window_line = 0;
+}
+
+void Fifo_StartLine(PIXEL_FIFO *f, const GRAPHICS *g){
+    const BYTE *io = g->memory->mem - WRAM0;
+    const LINE_STATE *state = &g->frame.lines[g->ly];
+    f->ly = g->ly;
+    f->dots = 0;
+    f->x = 0;
+    // Only the fine scroll is read at the start of the line. The coarse
+    // scroll is read again for every tile
+    f->discard = io[SCX_ADDR] % 8;
+    f->bg_count = 0;
+    f->obj_color = 0;
+    f->obj_attr = 0;
+    // The first fetch takes the time of two
+    f->step = FETCH_TILE;
+    f->step_dots = -FIFO_START_DELAY;
+    f->fetch_x = 0;
+    f->window = false;
+    f->window_reached = f->window_reached || io[WY_ADDR] == f->ly;
+    memcpy(f->sprites, state->sprites, state->sprite_count);
+    f->sprite_count = state->sprite_count;
+    f->next_sprite = 0;
+    f->obj_waiting = false;
+    f->obj_dots = 0;
+}
+
+/**
+ * Every dot, in order: a sprite fetch goes on (stalling everything else
+ * until it's done), the window can take over the fetcher, the fetcher takes
+ * a step, the shifter stops at any sprite that starts at the current pixel,
+ * and otherwise shifts a pixel out.
+ */
+void Fifo_Run(PIXEL_FIFO *f, const GRAPHICS *g, int dots){
+    const BYTE *io = g->memory->mem - WRAM0;
+    while(f->dots < dots && !Fifo_LineDone(f)){
+        f->dots++;
+        if(f->obj_waiting && f->step == FETCH_PUSH){
+            // The background fetch is done, so the fetcher moves on to the sprite
+            f->obj_waiting = false;
+            f->obj_dots = 1;
+        }
+        else if(f->obj_dots > 0){
+            f->obj_dots++;
+        }
+        if(f->obj_dots > 0){
+            if(f->obj_dots < FIFO_FETCH_DOTS){
+                continue;
+            }
+            FetchSprite(f, g);
+            f->obj_dots = 0;
+        }
+        CheckWindow(f, g, io);
+        StepFetcher(f, g, io);
+        if(f->bg_count > 0){
+            CheckSprites(f, g);
+            if(!f->obj_waiting){
+                ShiftPixel(f, g);
+            }
+        }
+    }
+}
+
+// The window starts once the shifter gets to WX - 7, by emptying the
+// background FIFO and fetching from the window's first tile instead
+static void CheckWindow(PIXEL_FIFO *f, const GRAPHICS *g, const BYTE *io){
+    BYTE wx = io[WX_ADDR];
+    if(f->window || !f->window_reached || !TEST_BIT(g->lcdc, 0) || !TEST_BIT(g->lcdc, 5) ||
+       wx > SCREEN_WIDTH + 6){
+        return;
+    }
+    // Nothing reaches the shifter until the first tile is fetched
+    if(f->bg_count == 0 && f->step != FETCH_PUSH){
+        return;
+    }
+    // With WX < 7 the window starts at the left edge, with its first
+    // 7 - WX pixels dropped
+    if(f->x != (wx < 7 ? 0 : wx - 7)){
+        return;
+    }
+    f->window = true;
+    f->discard = wx < 7 ? 7 - wx : 0;
+    f->bg_count = 0;
+    f->step = FETCH_TILE;
+    f->step_dots = 0;
+    f->fetch_x = 0;
+}
+
+// Reads a tile row one step at a time, and pushes it once the FIFO is empty
+static void StepFetcher(PIXEL_FIFO *f, const GRAPHICS *g, const BYTE *io){
+    const BYTE *vram = g->memory->vram;
+    if(f->step == FETCH_PUSH){
+        if(f->bg_count > 0){
+            return;
+        }
+        f->bg_low = f->tile_low;
+        f->bg_high = f->tile_high;
+        f->bg_count = 8;
+        f->fetch_x++;
+        // Fetching the next tile starts on the same dot
+        f->step = FETCH_TILE;
+        f->step_dots = 0;
+    }
+    if(++f->step_dots < 2){
+        return;
+    }
+    f->step_dots = 0;
+
+    BYTE y = f->window ? f->window_line : (BYTE) (f->ly + io[SCY_ADDR]);
+    if(f->step == FETCH_TILE){
+        WORD tile_map = TEST_BIT(g->lcdc, f->window ? 6 : 3) ? 0x9C00 : 0x9800;
+        int column = f->window ? f->fetch_x : io[SCX_ADDR] / 8 + f->fetch_x;
+        f->tile_id = vram[(tile_map - 0x8000) + (y / 8) * 32 + (column & 31)];
+        f->step = FETCH_LOW;
+        return;
+    }
+    const BYTE *tile_data;
+    if(TEST_BIT(g->lcdc, 4)){ // Tile data 0x8000-0x8FFF
+        tile_data = vram + f->tile_id * 16;
+    }
+    else{ // Tile data 0x8800-0x97FF, with tile 0 at 0x9000
+        tile_data = vram + 0x1000 + (SIGNED_BYTE) f->tile_id * 16;
+    }
+    if(f->step == FETCH_LOW){
+        f->tile_low = tile_data[(y % 8) * 2];
+        f->step = FETCH_HIGH;
+    }
+    else{
+        f->tile_high = tile_data[(y % 8) * 2 + 1];
+        f->step = FETCH_PUSH;
+    }
+}
+
+// Stops the shifter at the next sprite, if it starts at or left of the
+// current pixel. Sprites that start left of the screen are fetched as soon
+// as there's a pixel to stop, the rest once the dropped pixels are gone
+static void CheckSprites(PIXEL_FIFO *f, const GRAPHICS *g){
+    const BYTE *oam = g->memory->mem + (OAM - WRAM0);
+    if(f->obj_waiting){
+        return;
+    }
+    while(f->next_sprite < f->sprite_count){
+        int x = oam[f->sprites[f->next_sprite] * 4 + 1] - 8;
+        if(x > f->x || (x >= 0 && f->discard > 0)){
+            return;
+        }
+        if(TEST_BIT(g->lcdc, 1)){
+            f->obj_waiting = true;
+            f->obj_x = x;
+            return;
+        }
+        // With sprites off, they aren't fetched at all
+        f->next_sprite++;
+    }
+}
+
+// Mixes the next sprite's row into the sprite FIFO. Sprites fetched earlier
+// have priority, so only pixels that are still transparent are filled in
+static void FetchSprite(PIXEL_FIFO *f, const GRAPHICS *g){
+    const BYTE *oam = g->memory->mem + (OAM - WRAM0);
+    const BYTE *entry = oam + f->sprites[f->next_sprite++] * 4;
+    int height = TEST_BIT(g->lcdc, 2) ? 16 : 8;
+    int line = f->ly - (entry[0] - 16);
+    BYTE tile = entry[2];
+    BYTE attributes = entry[3];
+
+    // OAM or the sprite size may have changed since the OAM scan
+    if(line < 0 || line >= height){
+        return;
+    }
+    if(TEST_BIT(attributes, 6)){
+        line = height - 1 - line;
+    }
+    if(height == 16){
+        tile &= 0xFE;
+    }
+    const BYTE *tile_data = g->memory->vram + tile * 16 + line * 2;
+    // Pixels of a sprite that starts left of the shifter are already gone.
+    // OAM's X may have changed since, but the shifter stopped for this one
+    int first = f->x - f->obj_x;
+    for(int i = first; i < 8; i++){
+        int bit = TEST_BIT(attributes, 5) ? i : 7 - i;
+        BYTE color = ((tile_data[0] >> bit) & 0x01) | (((tile_data[1] >> bit) & 0x01) << 1);
+        int shift = (i - first) * 8;
+        if(color != 0 && ((f->obj_color >> shift) & 0xFF) == 0){
+            f->obj_color |= (uint64_t) color << shift;
+            f->obj_attr |= (uint64_t) attributes << shift;
+        }
+    }
+}
+
+// Sends the next pixel to the LCD, unless it's one that's dropped off the
+// left edge
+static void ShiftPixel(PIXEL_FIFO *f, const GRAPHICS *g){
+    BYTE bg = ((f->bg_high >> 6) & 0x02) | (f->bg_low >> 7);
+    f->bg_low <<= 1;
+    f->bg_high <<= 1;
+    f->bg_count--;
+    if(f->discard > 0){
+        f->discard--;
+        return;
+    }
+    BYTE obj = f->obj_color & 0xFF;
+    BYTE attributes = f->obj_attr & 0xFF;
+    f->obj_color >>= 8;
+    f->obj_attr >>= 8;
+
+    // With the background off, it's the lightest shade and never covers sprites
+    BYTE shade = 0;
+    if(TEST_BIT(g->lcdc, 0)){
+        shade = (g->palette_data[PALETTE_BG] >> (bg * 2)) & 0x03;
+    }
+    else{
+        bg = 0;
+    }
+    // Color 0 is transparent for sprites. With bit 7 set the sprite is
+    // also behind background colors 1-3
+    if(obj != 0 && TEST_BIT(g->lcdc, 1) && (!TEST_BIT(attributes, 7) || bg == 0)){
+        BYTE palette = g->palette_data[TEST_BIT(attributes, 4) ? PALETTE_OBJ1 : PALETTE_OBJ0];
+        shade = (palette >> (obj * 2)) & 0x03;
+    }
+    f->shades[f->ly][f->x++] = shade;
+    if(Fifo_LineDone(f) && f->window){
+        f->window_line++;
+    }
+}
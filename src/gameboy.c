@@ -2,6 +2,10 @@
 
 #include <stdlib.h>
 
+#ifdef PROFILE
+#include "profiler.h"
+#endif // PROFILE
+
 static const unsigned int CYCLES_PER_UPDATE = CLK_F / UPDATES_PER_SEC;
 
 GAMEBOY *GB_Create(){
@@ -15,7 +19,8 @@ GAMEBOY *GB_Create(){
         gb->joypad = Joypad_Create();
         gb->apu = APU_Create();
         if(gb->cpu == NULL || gb->memory == NULL || gb->timer == NULL ||
-           gb->graphics == NULL || gb->display == NULL || gb->joypad == NULL)
+           gb->graphics == NULL || gb->display == NULL || gb->joypad == NULL ||
+           gb->apu == NULL)
         {
             GB_Destroy(gb);
             gb = NULL;
@@ -24,11 +29,15 @@ GAMEBOY *GB_Create(){
             // Connect all the components that need to be connected
             CPU_SetMemory(gb->cpu, gb->memory);
             Timer_SetMemory(gb->timer, gb->memory);
+            Timer_SetClock(gb->timer, &gb->frame_cycles);
             Graphics_SetMemory(gb->graphics, gb->memory);
             Graphics_SetDisplay(gb->graphics, gb->display);
             Mem_SetJoypad(gb->memory, gb->joypad);
-            if(gb->apu != NULL)
-                APU_SetMemory(gb->apu, gb->memory);
+            Mem_SetTimer(gb->memory, gb->timer);
+            Mem_SetGraphics(gb->memory, gb->graphics);
+            Mem_SetAPU(gb->memory, gb->apu);
+            APU_SetMemory(gb->apu, gb->memory);
+            APU_SetClock(gb->apu, &gb->frame_cycles);
         }
     }
     return gb;
@@ -57,33 +66,45 @@ void GB_Startup(GAMEBOY *gb){
     if(gb != NULL){
         CPU_Startup(gb->cpu);
         Mem_Startup(gb->memory);
+        Timer_Startup(gb->timer);
+        Graphics_Startup(gb->graphics);
+        APU_Startup(gb->apu);
     }
 }
 
 void GB_Update(GAMEBOY *gb){
-    unsigned int total_cycles = 0;
     unsigned int cycles;
 
-    while(total_cycles < CYCLES_PER_UPDATE){
+    gb->frame_cycles = 0;
+    while(gb->frame_cycles < CYCLES_PER_UPDATE){
         if(!gb->cpu->stop){
             if(!gb->cpu->halt){
                 CPU_EmulateCycle(gb->cpu);
                 cycles = CPU_GetCycles(gb->cpu);
-                total_cycles += cycles;
-                APU_Update(gb->apu, (int) cycles);
+                gb->frame_cycles += cycles;
             }
             else{
                 cycles = 4;
-                total_cycles += 4;
+                gb->frame_cycles += 4;
+#ifdef PROFILE
+                Profiler_RecordHalt(gb->cpu, cycles);
+#endif // PROFILE
             } // endif halt
-            Timer_Update(gb->timer, cycles);
+            // The timer only has to run in time for TIMA's overflow
+            if(gb->frame_cycles >= gb->timer->overflow)
+                Timer_CatchUp(gb->timer);
             Graphics_Update(gb->graphics, cycles);
         }
         else{
             cycles = 4;
-            total_cycles += 4;
+            gb->frame_cycles += 4;
         } // endif stop
         Interrupt_Handle(gb->cpu);
     }
+    Timer_EndFrame(gb->timer);
+    APU_EndFrame(gb->apu);
     Graphics_RenderScreen(gb->graphics);
+#ifdef PROFILE
+    Profiler_Update();
+#endif // PROFILE
 }
\ No newline at end of file
@@ -1,299 +1,980 @@
 #include "graphics.h"
+#include "capture.h"
+#include "fifo.h"
 
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static unsigned int MapColor(int color, BYTE palette){
-    BYTE value = (palette >> (color * 2)) & 0x03;
-    if(value == 0)
-        return WHITE;
-    else if(value == 1)
-        return LIGHT_GRAY;
-    else if(value == 2)
-        return DARK_GRAY;
-    else
-        return BLACK;
-}
+#if defined(__AVX2__) || defined(__BMI2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Lightest to darkest, in the PIXEL color format
+static const unsigned int color_schemes[SCHEME_COUNT][4] = {
+    {0xFFFFFFFF, 0xC0C0C0FF, 0x606060FF, 0x000000FF}, // SCHEME_GRAY
+    {0x9BBC0FFF, 0x8BAC0FFF, 0x306230FF, 0x0F380FFF}, // SCHEME_DMG
+    {0xC4CFA1FF, 0x8B956DFF, 0x4D533CFF, 0x1F1F1FFF}, // SCHEME_POCKET
+    {0xE0F8D0FF, 0x88C070FF, 0x346856FF, 0x081820FF}  // SCHEME_LIGHT
+};
+
+// Every palette register value mapped to colors, for each scheme
+static unsigned int palette_tables[SCHEME_COUNT][256][4];
+
+#ifdef RENDER_THREAD
+/**
+ * A triple buffer passes the newest of a series of slots from one thread to
+ * another without locking. The producer fills its back slot and swaps it
+ * with the middle one; the consumer swaps its front slot with the middle one
+ * when the middle one is marked fresh. Slots the consumer falls behind on
+ * are simply replaced.
+ */
+#define SLOT_FRESH 0x04
+
+typedef struct{
+    SDL_atomic_t middle;
+    int back;  // Only used by the producer
+    int front; // Only used by the consumer
+} TRIPLE_BUFFER;
+
+// A frame on its way to the render thread
+typedef struct{
+    FRAME frame;
+    BYTE vram[0x2000];
+    BYTE oam[0xA0];
+    int first_line; // Lines before this were already drawn into pixels
+    PIXEL pixels[SCREEN_HEIGHT][SCREEN_WIDTH];
+    uint64_t line_hash[SCREEN_HEIGHT];
+} RENDER_JOB;
+
+struct render_thread{
+    SDL_Thread *thread;
+    SDL_sem *wake;
+    SDL_atomic_t quit;
+    TRIPLE_BUFFER jobs;   // Emulation thread to render thread
+    TRIPLE_BUFFER frames; // Render thread to Graphics_RenderScreen
+    RENDER_JOB job_slots[3];
+    PIXEL frame_slots[3][SCREEN_HEIGHT][SCREEN_WIDTH];
+    uint64_t frame_hashes[3][SCREEN_HEIGHT];
+};
+
+static bool TripleBuffer_Acquire(TRIPLE_BUFFER *b);
+static bool StartRenderThread(GRAPHICS *g);
+static void StopRenderThread(GRAPHICS *g);
+static void SubmitFrame(GRAPHICS *g);
+static bool Threaded(GRAPHICS *g);
+#endif // RENDER_THREAD
+
+
+static void UpdateSTATLine(GRAPHICS *g);
+static void SetMode(GRAPHICS *g, BYTE mode, int cycles);
+static void SetLY(GRAPHICS *g, BYTE ly);
+static void NextMode(GRAPHICS *g);
+static void StartFrame(GRAPHICS *g);
+static void LatchLine(GRAPHICS *g);
+static bool FinishFifoLine(GRAPHICS *g);
+static void CompareFrames(GRAPHICS *g);
+static uint64_t HashLine(const PIXEL *line);
+static void ShowFrame(GRAPHICS *g, PIXEL frame[SCREEN_HEIGHT][SCREEN_WIDTH], const uint64_t *line_hash);
+static void InitPaletteTables();
+#ifndef __BMI2__
+static void InitTileRowTable();
+#endif
 
 
 GRAPHICS *Graphics_Create(){
     GRAPHICS *graphics = malloc(sizeof(GRAPHICS));
     if(graphics != NULL){
         memset(graphics, 0, sizeof(GRAPHICS));
-        graphics->scanline_counter = CLK_PER_SCANLINE;
+        graphics->frame.pixels = graphics->frame_buffer;
+        graphics->frame.line_hash = graphics->line_hash;
+        InitPaletteTables();
+#ifndef __BMI2__
+        InitTileRowTable();
+#endif
+#ifdef RENDER_THREAD
+        // Without the thread, frames are just drawn inline
+        StartRenderThread(graphics);
+#endif // RENDER_THREAD
     }
     return graphics;
 }
 
 void Graphics_Destroy(GRAPHICS *g){
     if(g != NULL){
+#ifdef RENDER_THREAD
+        StopRenderThread(g);
+#endif // RENDER_THREAD
+        if(g->compared_frames > 0){
+            printf("Scanline renderer matched the pixel FIFO on %u of %u frames.\n",
+                   g->compared_frames - g->mismatched_frames, g->compared_frames);
+        }
+        Fifo_Destroy(g->fifo);
         free(g);
     }
 }
 
 void Graphics_SetMemory(GRAPHICS *g, MEMORY *mem){
     g->memory = mem;
+    g->frame.vram = mem->vram;
+    g->frame.oam = mem->mem + (OAM - WRAM0);
 }
 
 void Graphics_SetDisplay(GRAPHICS *g, DISPLAY *d){
     g->display = d;
 }
 
-void Graphics_Update(GRAPHICS *g, int cycles){
-    Graphics_UpdateLCDSTAT(g);
+void Graphics_Startup(GRAPHICS *g){
+    if(g != NULL){
+        g->lcdc = 0x91;
+        g->stat = 0x00;
+        g->lyc = 0x00;
+        g->ly = 0;
+        g->stat_line = false;
+        Graphics_WriteRegister(g, BGP_ADDR, 0xFC);
+        Graphics_WriteRegister(g, OBP0_ADDR, 0xFF);
+        Graphics_WriteRegister(g, OBP1_ADDR, 0xFF);
+        SetMode(g, MODE_SEARCH_OAM, MODE_SEARCH_CYCLES);
+    }
+}
 
+void Graphics_Update(GRAPHICS *g, int cycles){
     if(Graphics_LCDEnabled(g)){
-        g->scanline_counter -= cycles;
+        g->event_cycles -= cycles;
+        while(g->event_cycles <= 0){
+            NextMode(g);
+        }
+    }
+}
 
-        if(g->scanline_counter <= 0){
-            // Move to next scanline
-            BYTE current_line = Mem_ReadByte(g->memory, LY_ADDR);
-            Mem_ForceWrite(g->memory, LY_ADDR, ++current_line);
-            // Reset scanline_counter
-            g->scanline_counter = CLK_PER_SCANLINE;
+void Graphics_RenderScreen(GRAPHICS *g){
+#ifdef RENDER_THREAD
+    struct render_thread *rt = g->render_thread;
+    if(Threaded(g)){
+        if(TripleBuffer_Acquire(&rt->frames)){
+            ShowFrame(g, rt->frame_slots[rt->frames.front], rt->frame_hashes[rt->frames.front]);
+        }
+        return;
+    }
+#endif // RENDER_THREAD
+    if(g->frame_ready){
+        ShowFrame(g, g->frame_buffer, g->line_hash);
+        g->frame_ready = false;
+    }
+}
 
-            if(current_line == SCREEN_HEIGHT){
-                // End of visible screen. Request VBLANK interrupt
-                Mem_RequestInterrupt(g->memory, IF_VBLANK);
-            }
-            else if(current_line > VBLANK_END){
-                Mem_ForceWrite(g->memory, LY_ADDR, 0x00);
-            }
-            else if(current_line < SCREEN_HEIGHT){
-                Graphics_DrawScanline(g);
-            }
+// Works out which lines changed since the last frame shown, and only shows
+// the frame if any did
+static void ShowFrame(GRAPHICS *g, PIXEL frame[SCREEN_HEIGHT][SCREEN_WIDTH], const uint64_t *line_hash){
+    memset(&g->changed_lines, 0, sizeof(LINE_MASK));
+    for(int ly = 0; ly < SCREEN_HEIGHT; ly++){
+        if(line_hash[ly] != g->shown_hash[ly]){
+            g->changed_lines.bits[ly / 64] |= (uint64_t) 1 << (ly % 64);
+            g->shown_hash[ly] = line_hash[ly];
         }
     }
+    if(Graphics_FrameChanged(g)){
+        Display_RenderScreen(g->display, frame, &g->changed_lines);
+    }
 }
 
-void Graphics_RenderScreen(GRAPHICS *g){
-    Display_RenderScreen(g->display, g->frame_buffer);
+void Graphics_SetCapture(GRAPHICS *g, struct capture *c){
+    g->capture = c;
+}
+
+void Graphics_InvalidateScreen(GRAPHICS *g){
+    memset(g->shown_hash, 0, sizeof(g->shown_hash));
+}
+
+bool Graphics_FrameChanged(GRAPHICS *g){
+    uint64_t changed = 0;
+    for(int i = 0; i < (int) (sizeof(g->changed_lines.bits) / sizeof(uint64_t)); i++){
+        changed |= g->changed_lines.bits[i];
+    }
+    return changed != 0;
+}
+
+void Graphics_SetFrameSkip(GRAPHICS *g, int frames){
+    g->frame_skip = frames;
+}
+
+void Graphics_SkipNextFrame(GRAPHICS *g){
+    g->skip_next = true;
 }
 
 bool Graphics_LCDEnabled(GRAPHICS *g){
-    return TEST_BIT(Mem_ReadByte(g->memory, LCDC_ADDR), 7);
+    return TEST_BIT(g->lcdc, 7);
 }
 
-void Graphics_UpdateLCDSTAT(GRAPHICS *g){
-    BYTE status = Mem_ReadByte(g->memory, STAT_ADDR);
-    if(!Graphics_LCDEnabled(g)){
-        // Reset scanline
-        g->scanline_counter = CLK_PER_SCANLINE;
-        Mem_ForceWrite(g->memory, LY_ADDR, 0x00);
-        // Set LCD to mode 1
-        status &= 0xFC; // (1111 1100)_base2
-        status |= 0x01;
-        Mem_ForceWrite(g->memory, STAT_ADDR, status);
+bool Graphics_SetEngine(GRAPHICS *g, GRAPHICS_ENGINE engine){
+    if(engine != ENGINE_SCANLINE && g->fifo == NULL){
+        if((g->fifo = Fifo_Create()) == NULL){
+            return false;
+        }
     }
-    else{
-        BYTE current_line = Mem_ReadByte(g->memory, LY_ADDR);
-        BYTE current_mode = status & 0x03;
+    g->next_engine = engine;
+    return true;
+}
 
-        BYTE next_mode;
-        bool interrupt = false;
+const char *Graphics_EngineName(GRAPHICS_ENGINE engine){
+    static const char *names[ENGINE_COUNT] = {"Scanline", "Pixel FIFO", "Compare"};
+    return names[engine];
+}
 
-        if(current_line >= SCREEN_HEIGHT){
-            next_mode = MODE_VBLANK;
-            status &= 0xFC;
-            status |= 0x01;
-            interrupt = TEST_BIT(status, 5);
+void Graphics_SetColorScheme(GRAPHICS *g, COLOR_SCHEME scheme){
+    g->scheme = scheme;
+    g->frame.scheme = scheme;
+}
+
+// Each pair of bits in a palette register picks the shade for one color number
+static void InitPaletteTables(){
+    for(int scheme = 0; scheme < SCHEME_COUNT; scheme++){
+        for(int data = 0; data < 256; data++){
+            for(int color = 0; color < 4; color++){
+                palette_tables[scheme][data][color] = color_schemes[scheme][(data >> (color * 2)) & 0x03];
+            }
         }
-        else{
-            if(g->scanline_counter >= MODE_SEARCH_END){
-                next_mode = MODE_SEARCH_OAM;
-                status &= 0xFC;
-                status |= 0x02;
-                interrupt = TEST_BIT(status, 5);
+    }
+}
+
+BYTE Graphics_ReadRegister(GRAPHICS *g, WORD addr){
+    switch(addr){
+        case LCDC_ADDR:
+            return g->lcdc;
+        case STAT_ADDR:
+            // Bit 7 is unused and always reads as 1
+            return 0x80 | g->stat | ((g->ly == g->lyc) ? 0x04 : 0x00) | g->mode;
+        case LY_ADDR:
+            return g->ly;
+        case LYC_ADDR:
+            return g->lyc;
+        case BGP_ADDR:
+        case OBP0_ADDR:
+        case OBP1_ADDR:
+            return g->palette_data[addr - BGP_ADDR];
+        default:
+            return 0xFF;
+    };
+}
+
+void Graphics_WriteRegister(GRAPHICS *g, WORD addr, BYTE data){
+    Graphics_CatchUp(g);
+    switch(addr){
+        case LCDC_ADDR:
+            if(TEST_BIT(g->lcdc, 7) && !TEST_BIT(data, 7)){
+                // LCD turned off. LY is held at 0 and STAT reports mode 0
+                Graphics_FlushLines(g);
+                g->lcdc = data;
+                g->ly = 0;
+                g->mode = MODE_HBLANK;
+                // Whatever was left of the mode it was in is dropped
+                g->event_cycles = 0;
+                g->transfer_cycles = 0;
+                UpdateSTATLine(g);
             }
-            else if(g->scanline_counter >= MODE_TRANSFER_END){
-                next_mode = MODE_TRANSFER;
-                status &= 0xFC;
-                status |= 0x03;
+            else if(!TEST_BIT(g->lcdc, 7) && TEST_BIT(data, 7)){
+                // LCD turned on. Start over from the top of the screen, with
+                // a whole mode 2 ahead
+                g->lcdc = data;
+                g->event_cycles = 0;
+                g->transfer_cycles = 0;
+                StartFrame(g);
+                SetLY(g, 0);
+                SetMode(g, MODE_SEARCH_OAM, MODE_SEARCH_CYCLES);
             }
             else{
-                next_mode = MODE_HBLANK;
-                status &= 0xFC;
-                interrupt = TEST_BIT(status, 3);
+                g->lcdc = data;
             }
+            break;
+        case STAT_ADDR:
+            // The mode and coincidence bits are read only
+            g->stat = data & 0x78;
+            UpdateSTATLine(g);
+            break;
+        case LY_ADDR:
+            // Read only
+            break;
+        case LYC_ADDR:
+            g->lyc = data;
+            UpdateSTATLine(g);
+            break;
+        case BGP_ADDR:
+        case OBP0_ADDR:
+        case OBP1_ADDR:
+            g->palette_data[addr - BGP_ADDR] = data;
+            break;
+    };
+}
+
+// Decides whether the frame that's about to start gets drawn
+static void StartFrame(GRAPHICS *g){
+    // A capture has to get every frame, or it falls behind the game
+    if(g->capture == NULL && ((g->skip_next && g->skipped_frames < MAX_AUTO_SKIP) || g->skipped_frames < g->frame_skip)){
+        g->skip_frame = true;
+        g->skipped_frames++;
+    }
+    else{
+        g->skip_frame = false;
+        g->skipped_frames = 0;
+    }
+    g->skip_next = false;
+    g->engine = g->next_engine;
+    if(g->engine != ENGINE_SCANLINE){
+        Fifo_StartFrame(g->fifo);
+    }
+    g->lines_latched = 0;
+    g->lines_drawn = 0;
+    g->window_reached = false;
+    g->window_line = 0;
+}
+
+// Copies what the renderer needs to know about line LY. The sprites were
+// already filled in by Graphics_ScanOAM
+static void LatchLine(GRAPHICS *g){
+    const BYTE *io = g->memory->mem - WRAM0;
+    LINE_STATE *state = &g->frame.lines[g->ly];
+    state->lcdc = g->lcdc;
+    state->scx = io[SCX_ADDR];
+    state->scy = io[SCY_ADDR];
+    state->wx = io[WX_ADDR];
+    /**
+     * The window only starts once LY has matched WY at some point in the
+     * frame, and it's off the right edge with WX > 166. It keeps its own
+     * line counter, which only moves on lines where it was drawn, so turning
+     * it off for a few lines doesn't skip any of its lines.
+     */
+    g->window_reached = g->window_reached || io[WY_ADDR] == g->ly;
+    state->window = g->window_reached && TEST_BIT(g->lcdc, 0) && TEST_BIT(g->lcdc, 5) &&
+                    state->wx <= SCREEN_WIDTH + 6;
+    state->window_line = g->window_line;
+    if(state->window){
+        g->window_line++;
+    }
+    memcpy(state->palette_data, g->palette_data, sizeof(state->palette_data));
+    g->lines_latched = g->ly + 1;
+}
+
+void Graphics_FlushLines(GRAPHICS *g){
+    Graphics_CatchUp(g);
+    while(g->lines_drawn < g->lines_latched){
+        Graphics_DrawScanline(&g->frame, g->lines_drawn++);
+    }
+}
+
+// Mode 3 started transfer_cycles - event_cycles cycles ago, so that's how
+// far into the line the FIFO runs
+void Graphics_CatchUp(GRAPHICS *g){
+    if(g->engine != ENGINE_SCANLINE && g->mode == MODE_TRANSFER){
+        Fifo_Run(g->fifo, g, g->transfer_cycles - g->event_cycles);
+    }
+}
+
+// Finishes mode 3 for the pixel FIFO. Returns false if the FIFO isn't done
+// with the line yet, and pushes the end of mode 3 back instead
+static bool FinishFifoLine(GRAPHICS *g){
+    PIXEL_FIFO *f = g->fifo;
+    Graphics_CatchUp(g);
+    if(!Fifo_LineDone(f)){
+        // It can't take less than a dot for each pixel left
+        int left = SCREEN_WIDTH - f->x;
+        g->transfer_cycles += left;
+        g->event_cycles += left;
+        return false;
+    }
+    if(g->engine == ENGINE_FIFO && !g->skip_frame){
+        PIXEL *line = g->frame_buffer[f->ly];
+        for(int pixel = 0; pixel < SCREEN_WIDTH; pixel++){
+            line[pixel].color = color_schemes[g->frame.scheme][f->shades[f->ly][pixel]];
         }
-        
-        if(interrupt && (next_mode != current_mode)){
-            Mem_RequestInterrupt(g->memory, IF_LCD_STAT);
-        }
-        if(Mem_ReadByte(g->memory, LY_ADDR) == Mem_ReadByte(g->memory, LYC_ADDR)){
-            status |= 0x04; // Set bit 2
-            if(TEST_BIT(status, 6)){
-                Mem_RequestInterrupt(g->memory, IF_LCD_STAT);
+        g->line_hash[f->ly] = HashLine(line);
+    }
+    return true;
+}
+
+// Checks the frame the scanline renderer drew against the pixel FIFO's
+static void CompareFrames(GRAPHICS *g){
+    const unsigned int *colors = color_schemes[g->frame.scheme];
+    int lines = 0;
+    int first_line = 0;
+    int first_pixel = 0;
+    for(int ly = 0; ly < SCREEN_HEIGHT; ly++){
+        for(int pixel = 0; pixel < SCREEN_WIDTH; pixel++){
+            if(g->frame_buffer[ly][pixel].color != colors[g->fifo->shades[ly][pixel]]){
+                if(lines++ == 0){
+                    first_line = ly;
+                    first_pixel = pixel;
+                }
+                break;
             }
         }
-        else{
-            status &= ~(0x04); // Reset bit 2
-        }
-        Mem_ForceWrite(g->memory, STAT_ADDR, status);
+    }
+    g->compared_frames++;
+    if(lines > 0){
+        g->mismatched_frames++;
+        printf("Frame %u: %d lines differ from the pixel FIFO, starting at line %d, pixel %d.\n",
+               g->compared_frames, lines, first_line, first_pixel);
     }
 }
 
-void Graphics_DrawScanline(GRAPHICS *g){
-    BYTE control = Mem_ReadByte(g->memory, LCDC_ADDR);
-    if(TEST_BIT(control, 0)){
-        // Bit 0 is the BG enable
-        Graphics_RenderTiles(g, control);
+// All enabled STAT sources are OR'ed into a single interrupt line, so a new
+// source only causes an interrupt if none of the others were already active
+static void UpdateSTATLine(GRAPHICS *g){
+    bool line = false;
+    if(Graphics_LCDEnabled(g)){
+        line = (TEST_BIT(g->stat, 6) && g->ly == g->lyc) ||
+               (TEST_BIT(g->stat, 5) && g->mode == MODE_SEARCH_OAM) ||
+               (TEST_BIT(g->stat, 4) && g->mode == MODE_VBLANK) ||
+               (TEST_BIT(g->stat, 3) && g->mode == MODE_HBLANK);
     }
-    if(TEST_BIT(control, 1)){
-        // Bit 1 is the Sprite enable
-        Graphics_RenderSprites(g, control);
+    if(line && !g->stat_line){
+        Mem_RequestInterrupt(g->memory, IF_LCD_STAT);
     }
+    g->stat_line = line;
 }
 
-void Graphics_RenderTiles(GRAPHICS *g, BYTE lcdc){
-    /**
-     * One tile is 8px X 8px
-     * Entire screen is 256 px(32 tiles) X 256 px(32 tiles)
-     * Visible screen is 160 px(20 tiles) X 144 px (18 tiles)
-     * Each tile in memory occupies 16 bytes (2 bytes/tile)
-     */
-    WORD tile_data; // For location of tile informatorn
-    WORD tile_map;  // For description of what tile goes where
-    
-    BYTE scanline = Mem_ReadByte(g->memory, LY_ADDR) - 1;
-    BYTE scrollY  = Mem_ReadByte(g->memory, SCY_ADDR);
-    BYTE scrollX  = Mem_ReadByte(g->memory, SCX_ADDR);
-    BYTE windowY  = Mem_ReadByte(g->memory, WY_ADDR);
-    BYTE windowX  = Mem_ReadByte(g->memory, WX_ADDR) - 7;
+static void SetMode(GRAPHICS *g, BYTE mode, int cycles){
+    g->mode = mode;
+    g->event_cycles += cycles;
+    UpdateSTATLine(g);
+}
 
-    bool tileID_signed = false;
-    bool window = false;
+static void SetLY(GRAPHICS *g, BYTE ly){
+    g->ly = ly;
+    UpdateSTATLine(g);
+}
 
-    if(TEST_BIT(lcdc, 5) && windowY <= scanline){
-        window = true;
-    }
+// Called whenever event_cycles runs out
+static void NextMode(GRAPHICS *g){
+    switch(g->mode){
+        case MODE_SEARCH_OAM:
+            // The pixel FIFO needs the sprites for its timing, even on
+            // skipped frames
+            if(!g->skip_frame || g->engine != ENGINE_SCANLINE){
+                Graphics_ScanOAM(g);
+            }
+            g->transfer_cycles = MODE_TRANSFER_CYCLES;
+            if(g->engine != ENGINE_SCANLINE){
+                Fifo_StartLine(g->fifo, g);
+            }
+            SetMode(g, MODE_TRANSFER, MODE_TRANSFER_CYCLES);
+            break;
+        case MODE_TRANSFER:
+            if(g->engine != ENGINE_SCANLINE && !FinishFifoLine(g)){
+                break;
+            }
+            if(!g->skip_frame && g->engine != ENGINE_FIFO){
+                LatchLine(g);
+            }
+            SetMode(g, MODE_HBLANK, CLK_PER_SCANLINE - MODE_SEARCH_CYCLES - g->transfer_cycles);
+            break;
+        case MODE_HBLANK:
+            SetLY(g, g->ly + 1);
+            if(g->ly == SCREEN_HEIGHT){
+                // End of visible screen. Request VBLANK interrupt
+                Mem_RequestInterrupt(g->memory, IF_VBLANK);
+#ifdef RENDER_THREAD
+                if(Threaded(g) && !g->skip_frame){
+                    SubmitFrame(g);
+                }
+#endif // RENDER_THREAD
+                Graphics_FlushLines(g);
+                if(g->engine == ENGINE_COMPARE && !g->skip_frame){
+                    CompareFrames(g);
+                }
+                g->frame_ready = g->frame_ready || !g->skip_frame;
+                // Captures get every frame, not just the ones shown. While
+                // there's one, frames are drawn here instead of on the
+                // render thread, which can drop them
+                if(g->capture != NULL && !g->skip_frame){
+                    Capture_Frame(g->capture, g->frame_buffer, color_schemes[g->frame.scheme]);
+                }
+                SetMode(g, MODE_VBLANK, CLK_PER_SCANLINE);
+            }
+            else{
+                SetMode(g, MODE_SEARCH_OAM, MODE_SEARCH_CYCLES);
+            }
+            break;
+        case MODE_VBLANK:
+            if(g->ly == VBLANK_END){
+                StartFrame(g);
+                SetLY(g, 0);
+                SetMode(g, MODE_SEARCH_OAM, MODE_SEARCH_CYCLES);
+            }
+            else{
+                SetLY(g, g->ly + 1);
+                g->event_cycles += CLK_PER_SCANLINE;
+            }
+            break;
+    };
+}
 
-    if(TEST_BIT(lcdc, 4)){ // Tile data 0x8000-0x8FFF
-        tile_data = 0x8000;
+void Graphics_ScanOAM(GRAPHICS *g){
+    const BYTE *oam = g->memory->mem + (OAM - WRAM0);
+    LINE_STATE *state = &g->frame.lines[g->ly];
+    int height = TEST_BIT(g->lcdc, 2) ? 16 : 8;
+    int count = 0;
+
+    for(int sprite = 0; sprite < 40 && count < MAX_LINE_SPRITES; sprite++){
+        int y = oam[sprite * 4] - 16;
+        if(g->ly < y || g->ly >= y + height){
+            continue;
+        }
+        // Insertion sort by X. Sprites with the same X stay in OAM order
+        BYTE x = oam[sprite * 4 + 1];
+        int i = count++;
+        while(i > 0 && oam[state->sprites[i - 1] * 4 + 1] > x){
+            state->sprites[i] = state->sprites[i - 1];
+            i--;
+        }
+        state->sprites[i] = sprite;
     }
-    else{ // Tile data 0x8800-0x97FF
-        tile_data = 0x8800;
-        tileID_signed = true;
+    state->sprite_count = count;
+}
+
+/**
+ * Only has to tell a line apart from the one shown before it, so it's FNV-1a
+ * over the pixels 2 at a time, split into 4 lanes that don't depend on each
+ * other. That keeps 4 multiplies in flight instead of waiting on each one.
+ */
+static uint64_t HashLine(const PIXEL *line){
+    uint64_t a = 0xCBF29CE484222325, b = a + 1, c = a + 2, d = a + 3;
+    for(int pixel = 0; pixel < SCREEN_WIDTH; pixel += 8){
+        uint64_t pairs[4];
+        memcpy(pairs, &line[pixel], sizeof(pairs));
+        a = (a ^ pairs[0]) * 0x00000100000001B3;
+        b = (b ^ pairs[1]) * 0x00000100000001B3;
+        c = (c ^ pairs[2]) * 0x00000100000001B3;
+        d = (d ^ pairs[3]) * 0x00000100000001B3;
     }
+    return a ^ (b * 3) ^ (c * 5) ^ (d * 7);
+}
 
-    if(window){
-        tile_map = (TEST_BIT(lcdc, 6)) ? 0x9C00 : 0x9800;
+void Graphics_DrawScanline(const FRAME *f, int ly){
+    BYTE control = f->lines[ly].lcdc;
+    PIXEL *line = f->pixels[ly];
+    BYTE bg_index[SCREEN_WIDTH]; // Color numbers of the background pixels
+
+    if(TEST_BIT(control, 0)){
+        // Bit 0 is the BG enable
+        Graphics_RenderTiles(f, ly, line, bg_index);
     }
     else{
-        tile_map = (TEST_BIT(lcdc, 3)) ? 0x9C00 : 0x9800;
+        memset(bg_index, 0, sizeof(bg_index));
+        // The screen is blank, which is always the lightest shade
+        for(int pixel = 0; pixel < SCREEN_WIDTH; pixel++){
+            line[pixel].color = color_schemes[f->scheme][0];
+        }
+    }
+    if(TEST_BIT(control, 1)){
+        // Bit 1 is the Sprite enable
+        Graphics_RenderSprites(f, ly, line, bg_index);
     }
+    f->line_hash[ly] = HashLine(line);
+}
 
-    BYTE yPos;
-    BYTE xPos;
-    if(!window){
-        yPos = scrollY + scanline;
+/**
+ * Tiles are drawn a whole row (8 pixels) at a time. Each row is 2 bytes: the
+ * first holds bit 0 of every pixel's color number and the second holds bit 1,
+ * with pixel 0 in bit 7. A row is first spread out into 8 color numbers, one
+ * per byte, and those are then looked up in the 4 entry palette together.
+ * Rows that are cut off by the edge of the screen are drawn a pixel at a time.
+ */
+
+#ifndef __BMI2__
+// Byte n of each entry holds bit (7 - n) of the index
+static uint64_t tile_row_table[256];
+
+static void InitTileRowTable(){
+    for(int bits = 0; bits < 256; bits++){
+        BYTE *row = (BYTE *) &tile_row_table[bits];
+        for(int pixel = 0; pixel < 8; pixel++){
+            row[pixel] = (bits >> (7 - pixel)) & 0x01;
+        }
     }
-    else{
-        yPos = scanline - windowY;
+}
+#endif
+
+// Returns the 8 color numbers of a tile row, pixel 0 in the lowest byte
+static inline uint64_t DecodeTileRow(BYTE low, BYTE high){
+#ifdef __BMI2__
+    // PDEP puts bit n in byte n, which is backwards from the screen order
+    return __builtin_bswap64(_pdep_u64(low, 0x0101010101010101ULL) |
+                             _pdep_u64(high, 0x0202020202020202ULL));
+#else
+    return tile_row_table[low] | (tile_row_table[high] << 1);
+#endif
+}
+
+static inline BYTE RowPixel(uint64_t row, int pixel){
+    return (row >> (pixel * 8)) & 0x03;
+}
+
+// A palette table, plus the same colors in the form the vector lookups below
+// want them
+typedef struct{
+    unsigned int colors[4];
+#if defined(__AVX2__)
+    __m256i vector;    // Whole palette in the low half
+#elif defined(__SSSE3__)
+    __m128i vector;    // Whole palette
+#elif defined(__SSE2__)
+    __m128i vector[4]; // Each color repeated across its own register
+#endif
+} PALETTE;
+
+static void LoadPalette(PALETTE *p, const unsigned int *colors){
+    memcpy(p->colors, colors, sizeof(p->colors));
+#if defined(__AVX2__)
+    p->vector = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) p->colors));
+#elif defined(__SSSE3__)
+    p->vector = _mm_loadu_si128((const __m128i *) p->colors);
+#elif defined(__SSE2__)
+    for(int i = 0; i < 4; i++){
+        p->vector[i] = _mm_set1_epi32(p->colors[i]);
     }
+#endif
+}
+
+#if defined(__SSE2__) && !defined(__AVX2__)
+// Zero extends the 8 color numbers of a row to 32 bits, 4 per register
+static inline void ExpandRow(uint64_t row, __m128i *left, __m128i *right){
+    __m128i zero = _mm_setzero_si128();
+    __m128i words = _mm_unpacklo_epi8(_mm_set_epi64x(0, row), zero);
+    *left = _mm_unpacklo_epi16(words, zero);
+    *right = _mm_unpackhi_epi16(words, zero);
+}
 
-    // x32 because there's 32 tiles per row
-    WORD tile_row = (yPos / 8) * 32;
-    WORD tile_col;
-    WORD tile_addr;
-    WORD tile_data_addr;
-    SIGNED_WORD tileID;
+static inline __m128i LookupColors4(__m128i index, const PALETTE *palette){
+#ifdef __SSSE3__
+    // Turn every index n into the byte offsets 4n..4n+3 of its palette entry
+    const __m128i spread = _mm_setr_epi8(0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12);
+    const __m128i offset = _mm_setr_epi8(0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3);
+    __m128i bytes = _mm_add_epi8(_mm_shuffle_epi8(_mm_slli_epi32(index, 2), spread), offset);
+    return _mm_shuffle_epi8(palette->vector, bytes);
+#else
+    // Pick between colors using the two bits of the index as masks
+    const __m128i one = _mm_set1_epi32(1);
+    __m128i bit0 = _mm_cmpeq_epi32(_mm_and_si128(index, one), one);
+    __m128i bit1 = _mm_cmpgt_epi32(index, one);
+    __m128i low = _mm_or_si128(_mm_and_si128(bit0, palette->vector[1]), _mm_andnot_si128(bit0, palette->vector[0]));
+    __m128i high = _mm_or_si128(_mm_and_si128(bit0, palette->vector[3]), _mm_andnot_si128(bit0, palette->vector[2]));
+    return _mm_or_si128(_mm_and_si128(bit1, high), _mm_andnot_si128(bit1, low));
+#endif
+}
+
+static inline __m128i BlendColors4(__m128i mask, __m128i sprite, __m128i under){
+    return _mm_or_si128(_mm_and_si128(mask, sprite), _mm_andnot_si128(mask, under));
+}
+#endif
 
-    for(int pixel = 0; pixel < SCREEN_WIDTH; pixel++){
-        xPos = pixel + scrollX;
-        if(window && pixel >= windowX){
-            xPos = pixel - windowX;
+// Sets every byte of a decoded row that isn't color number 0 to 0xFF, and
+// the rest to 0
+static inline uint64_t OpaqueMask(uint64_t row){
+    return ((row | (row >> 1)) & 0x0101010101010101ULL) * 0xFF;
+}
+
+// Maps the 8 color numbers of a decoded row and stores them at out
+static inline void DrawTileRow(uint64_t row, const PALETTE *palette, PIXEL *out){
+#if defined(__AVX2__)
+    __m256i index = _mm256_cvtepu8_epi32(_mm_set_epi64x(0, row));
+    _mm256_storeu_si256((__m256i *) out, _mm256_permutevar8x32_epi32(palette->vector, index));
+#elif defined(__SSE2__)
+    __m128i left, right;
+    ExpandRow(row, &left, &right);
+    _mm_storeu_si128((__m128i *) out, LookupColors4(left, palette));
+    _mm_storeu_si128((__m128i *) (out + 4), LookupColors4(right, palette));
+#else
+    for(int i = 0; i < 8; i++){
+        out[i].color = palette->colors[RowPixel(row, i)];
+    }
+#endif
+}
+
+// Same as DrawTileRow, but only the pixels whose byte in mask is 0xFF are drawn
+static inline void BlendSpriteRow(uint64_t row, const PALETTE *palette, uint64_t mask, PIXEL *out){
+#if defined(__AVX2__)
+    __m256i index = _mm256_cvtepu8_epi32(_mm_set_epi64x(0, row));
+    __m256i sprite = _mm256_permutevar8x32_epi32(palette->vector, index);
+    __m256i draw = _mm256_cvtepi8_epi32(_mm_set_epi64x(0, mask));
+    __m256i under = _mm256_loadu_si256((const __m256i *) out);
+    _mm256_storeu_si256((__m256i *) out, _mm256_blendv_epi8(under, sprite, draw));
+#elif defined(__SSE2__)
+    __m128i left, right;
+    ExpandRow(row, &left, &right);
+    __m128i draw = _mm_set_epi64x(0, mask);
+    draw = _mm_unpacklo_epi8(draw, draw);
+    __m128i *pixels = (__m128i *) out;
+    _mm_storeu_si128(pixels, BlendColors4(_mm_unpacklo_epi16(draw, draw), LookupColors4(left, palette), _mm_loadu_si128(pixels)));
+    _mm_storeu_si128(pixels + 1, BlendColors4(_mm_unpackhi_epi16(draw, draw), LookupColors4(right, palette), _mm_loadu_si128(pixels + 1)));
+#else
+    for(int i = 0; i < 8; i++){
+        if((mask >> (i * 8)) & 0xFF){
+            out[i].color = palette->colors[RowPixel(row, i)];
         }
+    }
+#endif
+}
 
-        tile_col = xPos / 8;
-        tile_addr = tile_map + tile_row + tile_col;
-        if(tileID_signed){
-            tileID = (SIGNED_BYTE) Mem_ReadByte(g->memory, tile_addr);
+// Draws count pixels from one row of a tile map, starting at map position
+// (x, y), and stores their color numbers in index
+static void RenderTileRun(const FRAME *f, BYTE lcdc, WORD tile_map, BYTE x, BYTE y,
+                          const PALETTE *palette, PIXEL *out, BYTE *index, int count){
+    const BYTE *vram = f->vram;
+    const BYTE *map_row = vram + (tile_map - 0x8000) + (y / 8) * 32;
+    bool unsigned_ids = TEST_BIT(lcdc, 4);
+    int tile_line = (y % 8) * 2;
+    int tile_col = x / 8;
+    int skip = x % 8;  // Pixels of the first tile that are off the left edge
+
+    for(int pixel = 0; pixel < count; tile_col++){
+        BYTE tileID = map_row[tile_col & 31];
+        const BYTE *tile_data;
+        if(unsigned_ids){ // Tile data 0x8000-0x8FFF
+            tile_data = vram + tileID * 16;
         }
-        else{
-            tileID = Mem_ReadByte(g->memory, tile_addr);
+        else{ // Tile data 0x8800-0x97FF, with tile 0 at 0x9000
+            tile_data = vram + 0x1000 + (SIGNED_BYTE) tileID * 16;
         }
+        uint64_t row = DecodeTileRow(tile_data[tile_line], tile_data[tile_line + 1]);
 
-        tile_data_addr = tile_data;
-        if(tileID_signed){
-            tile_data_addr += (tileID + 128) * 16;
+        if(skip == 0 && count - pixel >= 8){
+            DrawTileRow(row, palette, out + pixel);
+            memcpy(index + pixel, &row, sizeof(row));
+            pixel += 8;
         }
         else{
-            tile_data_addr += tileID * 16;
+            for(int i = skip; i < 8 && pixel < count; i++, pixel++){
+                index[pixel] = RowPixel(row, i);
+                out[pixel].color = palette->colors[index[pixel]];
+            }
+            skip = 0;
         }
+    }
+}
 
-        BYTE line = (yPos % 8) * 2;
-        BYTE color_data1 = Mem_ReadByte(g->memory, tile_data_addr + line);
-        BYTE color_data2 = Mem_ReadByte(g->memory, tile_data_addr + line + 1);
-
-        // Pixel 0 maps to bit 7, pixel 1 to bit 6, etc.
-        int color_bit = ~((xPos % 8) - 7) + 1;
-
-        int color_num = (TEST_BIT(color_data2, color_bit)) ? 0x02 : 0x00;
-        color_num += (TEST_BIT(color_data1, color_bit)) ? 0x01 : 0x00;
-
-        g->frame_buffer[pixel][scanline].color = MapColor(color_num, Mem_ReadByte(g->memory, BGP_ADDR));
+void Graphics_RenderTiles(const FRAME *f, int ly, PIXEL *line, BYTE *bg_index){
+    /**
+     * One tile is 8px X 8px
+     * Entire screen is 256 px(32 tiles) X 256 px(32 tiles)
+     * Visible screen is 160 px(20 tiles) X 144 px (18 tiles)
+     * Each tile in memory occupies 16 bytes (2 bytes/tile)
+     */
+    const LINE_STATE *state = &f->lines[ly];
+    BYTE lcdc     = state->lcdc;
+    BYTE scanline = ly;
+    BYTE scrollY  = state->scy;
+    BYTE scrollX  = state->scx;
+
+    PALETTE palette;
+    LoadPalette(&palette, palette_tables[f->scheme][state->palette_data[PALETTE_BG]]);
+
+    // The window covers everything right of WX - 7. With WX < 7 its first
+    // few pixels are off the left edge instead
+    int split = SCREEN_WIDTH;
+    BYTE window_x = 0;
+    if(state->window){
+        split = state->wx - 7;
+        if(split < 0){
+            window_x = -split;
+            split = 0;
+        }
+    }
+    if(split > 0){
+        WORD tile_map = (TEST_BIT(lcdc, 3)) ? 0x9C00 : 0x9800;
+        RenderTileRun(f, lcdc, tile_map, scrollX, scrollY + scanline, &palette, line, bg_index, split);
+    }
+    if(split < SCREEN_WIDTH){
+        WORD tile_map = (TEST_BIT(lcdc, 6)) ? 0x9C00 : 0x9800;
+        RenderTileRun(f, lcdc, tile_map, window_x, state->window_line, &palette,
+                      line + split, bg_index + split, SCREEN_WIDTH - split);
     }
 }
 
-void Graphics_RenderSprites(GRAPHICS *g, BYTE lcdc)
+void Graphics_RenderSprites(const FRAME *f, int ly, PIXEL *line, const BYTE *bg_index)
 {
+    const LINE_STATE *state = &f->lines[ly];
+    const BYTE *vram = f->vram;
+    const BYTE *oam = f->oam;
+    int scanline = ly;
+
     // Double height sprites are 8x16 (as opposed to 8x8)
-    bool double_height = false;
+    int ysize = TEST_BIT(state->lcdc, 2) ? 16 : 8;
 
-    BYTE scanline = Mem_ReadByte(g->memory, LY_ADDR) - 1;
+    PALETTE palettes[2];
+    LoadPalette(&palettes[0], palette_tables[f->scheme][state->palette_data[PALETTE_OBJ0]]);
+    LoadPalette(&palettes[1], palette_tables[f->scheme][state->palette_data[PALETTE_OBJ1]]);
 
-    if (TEST_BIT(lcdc, 2))
-        double_height = true;
+    // 0xFF where a higher priority sprite has already drawn a pixel. Those
+    // pixels stay covered even if that sprite is hidden behind the background
+    BYTE owned[SCREEN_WIDTH];
+    memset(owned, 0, sizeof(owned));
 
-    for (int sprite = 0; sprite < 40; sprite++)
+    for (int sprite = 0; sprite < state->sprite_count; sprite++)
     {
         // sprite occupies 4 bytes in the sprite attributes table
-        BYTE index = sprite * 4;
-        BYTE yPos = Mem_ReadByte(g->memory, 0xFE00 + index) - 16;
-        BYTE xPos = Mem_ReadByte(g->memory, 0xFE00 + index + 1) - 8;
-        BYTE tileLocation = Mem_ReadByte(g->memory, 0xFE00 + index + 2);
-        BYTE attributes = Mem_ReadByte(g->memory, 0xFE00 + index + 3);
-
-        bool yFlip = TEST_BIT(attributes, 6);
-        bool xFlip = TEST_BIT(attributes, 5);
-
-        int ysize = double_height ? 16 : 8;
-
-        // does this sprite intercept with the scanline?
-        if ((scanline >= yPos) && (scanline < (yPos + ysize)))
+        const BYTE *entry = oam + state->sprites[sprite] * 4;
+        int yPos = entry[0] - 16;
+        int xPos = entry[1] - 8;
+        BYTE tileLocation = entry[2];
+        BYTE attributes = entry[3];
+
+        // sprite's line number, read backwards in the y axis if flipped.
+        // LCDC may have changed the sprite size since the OAM scan
+        int tile_line = scanline - yPos;
+        if (tile_line < 0 || tile_line >= ysize || xPos <= -8 || xPos >= SCREEN_WIDTH)
+            continue;
+        if (TEST_BIT(attributes, 6))
+            tile_line = ysize - 1 - tile_line;
+
+        // The low bit of the tile number is ignored for 8x16 sprites
+        if (ysize == 16)
+            tileLocation &= 0xFE;
+
+        const BYTE *tile_data = vram + tileLocation * 16 + tile_line * 2;
+        uint64_t row = DecodeTileRow(tile_data[0], tile_data[1]);
+        if (TEST_BIT(attributes, 5))
+            row = __builtin_bswap64(row);
+
+        // Color 0 is transparent for sprites. With bit 7 set the sprite is
+        // also behind background colors 1-3
+        const PALETTE *palette = &palettes[TEST_BIT(attributes, 4)];
+        bool behind = TEST_BIT(attributes, 7);
+        if (xPos >= 0 && xPos <= SCREEN_WIDTH - 8)
+        {
+            uint64_t covered, background;
+            memcpy(&covered, owned + xPos, sizeof(covered));
+            memcpy(&background, bg_index + xPos, sizeof(background));
+            uint64_t mask = OpaqueMask(row) & ~covered;
+            covered |= mask;
+            memcpy(owned + xPos, &covered, sizeof(covered));
+            if (behind)
+                mask &= ~OpaqueMask(background);
+            BlendSpriteRow(row, palette, mask, line + xPos);
+        }
+        else
         {
-            // sprite's line number
-            int line = scanline - yPos;
+            for (int i = 0; i < 8; i++)
+            {
+                int x = xPos + i;
+                BYTE index = RowPixel(row, i);
+                if (index == 0 || x < 0 || x >= SCREEN_WIDTH || owned[x])
+                    continue;
+                owned[x] = 0xFF;
+                if (!behind || bg_index[x] == 0)
+                    line[x].color = palette->colors[index];
+            }
+        }
+    }
+}
 
-            // read the sprite in backwards in the y axis
-            if (yFlip)
-                line = ~(line - ysize) + 1;
+#ifdef RENDER_THREAD
+static void TripleBuffer_Init(TRIPLE_BUFFER *b){
+    b->back = 0;
+    SDL_AtomicSet(&b->middle, 1);
+    b->front = 2;
+}
 
-            line *= 2; // 2 bytes/row
-            WORD dataAddress = 0x8000 + (tileLocation * 16) + line;
-            BYTE color_data1 = Mem_ReadByte(g->memory, dataAddress);
-            BYTE color_data2 = Mem_ReadByte(g->memory, dataAddress + 1);
+// Producer: hands over the back slot and takes the middle one in its place
+static void TripleBuffer_Publish(TRIPLE_BUFFER *b){
+    b->back = SDL_AtomicSet(&b->middle, b->back | SLOT_FRESH) & ~SLOT_FRESH;
+}
 
-            // read colors from bit 7 to 0
-            for (int tilePixel = 7; tilePixel >= 0; tilePixel--)
-            {
-                int colorbit = tilePixel;
-                if (xFlip)
-                    colorbit = ~(colorbit - 7) + 1;
+// Consumer: takes the newest slot, if there's one it hasn't seen yet
+static bool TripleBuffer_Acquire(TRIPLE_BUFFER *b){
+    if(!(SDL_AtomicGet(&b->middle) & SLOT_FRESH)){
+        return false;
+    }
+    b->front = SDL_AtomicSet(&b->middle, b->front) & ~SLOT_FRESH;
+    return true;
+}
 
-                // the rest is the same as for tiles
-                int colorNum = TEST_BIT(color_data2, colorbit) ? 0x02 : 0x00;
-                colorNum += TEST_BIT(color_data1, colorbit) ? 0x01 : 0x00;
+static int RenderThread(void *data){
+    struct render_thread *rt = data;
+    while(true){
+        SDL_SemWait(rt->wake);
+        if(SDL_AtomicGet(&rt->quit)){
+            break;
+        }
+        if(!TripleBuffer_Acquire(&rt->jobs)){
+            continue;
+        }
+        RENDER_JOB *job = &rt->job_slots[rt->jobs.front];
+        job->frame.pixels = rt->frame_slots[rt->frames.back];
+        job->frame.line_hash = rt->frame_hashes[rt->frames.back];
+        memcpy(job->frame.pixels, job->pixels, job->first_line * sizeof(job->pixels[0]));
+        memcpy(job->frame.line_hash, job->line_hash, job->first_line * sizeof(uint64_t));
+        for(int ly = job->first_line; ly < SCREEN_HEIGHT; ly++){
+            Graphics_DrawScanline(&job->frame, ly);
+        }
+        TripleBuffer_Publish(&rt->frames);
+    }
+    return 0;
+}
 
-                WORD colorAddress = TEST_BIT(attributes, 4) ? 0xFF49 : 0xFF48;
-                unsigned int color = MapColor(colorNum, Mem_ReadByte(g->memory, colorAddress));
+static bool StartRenderThread(GRAPHICS *g){
+    struct render_thread *rt = malloc(sizeof(struct render_thread));
+    if(rt == NULL){
+        return false;
+    }
+    memset(rt, 0, sizeof(struct render_thread));
+    TripleBuffer_Init(&rt->jobs);
+    TripleBuffer_Init(&rt->frames);
+    for(int i = 0; i < 3; i++){
+        rt->job_slots[i].frame.vram = rt->job_slots[i].vram;
+        rt->job_slots[i].frame.oam = rt->job_slots[i].oam;
+    }
+    if((rt->wake = SDL_CreateSemaphore(0)) == NULL){
+        free(rt);
+        return false;
+    }
+    if((rt->thread = SDL_CreateThread(RenderThread, "render", rt)) == NULL){
+        SDL_DestroySemaphore(rt->wake);
+        free(rt);
+        return false;
+    }
+    g->render_thread = rt;
+    return true;
+}
 
-                // white is transparent for sprites.
-                if (color != WHITE){
-                    g->frame_buffer[xPos - tilePixel + 7][scanline].color = color;
-                }
-            }
-        }
+static void StopRenderThread(GRAPHICS *g){
+    struct render_thread *rt = g->render_thread;
+    if(rt != NULL){
+        SDL_AtomicSet(&rt->quit, 1);
+        SDL_SemPost(rt->wake);
+        SDL_WaitThread(rt->thread, NULL);
+        SDL_DestroySemaphore(rt->wake);
+        free(rt);
+        g->render_thread = NULL;
     }
-}
\ No newline at end of file
+}
+
+// Whether the current frame goes to the render thread. Only the scanline
+// renderer uses it, and not while there's a capture
+static bool Threaded(GRAPHICS *g){
+    return g->render_thread != NULL && g->engine == ENGINE_SCANLINE && g->capture == NULL;
+}
+
+// Hands the rest of the frame to the render thread, at VBLANK
+static void SubmitFrame(GRAPHICS *g){
+    struct render_thread *rt = g->render_thread;
+    RENDER_JOB *job = &rt->job_slots[rt->jobs.back];
+
+    memcpy(job->frame.lines, g->frame.lines, sizeof(job->frame.lines));
+    job->frame.scheme = g->frame.scheme;
+    memcpy(job->vram, g->frame.vram, sizeof(job->vram));
+    memcpy(job->oam, g->frame.oam, sizeof(job->oam));
+    // Lines drawn early because of VRAM or OAM writes go along as they are
+    job->first_line = g->lines_drawn;
+    memcpy(job->pixels, g->frame_buffer, g->lines_drawn * sizeof(job->pixels[0]));
+    memcpy(job->line_hash, g->line_hash, g->lines_drawn * sizeof(uint64_t));
+    g->lines_drawn = g->lines_latched;
+
+    TripleBuffer_Publish(&rt->jobs);
+    SDL_SemPost(rt->wake);
+}
+#endif // RENDER_THREAD
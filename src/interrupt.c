@@ -1,36 +1,47 @@
 #include "interrupt.h"
 #include "memory.h"
 
+#ifdef PROFILE
+#include "profiler.h"
+#endif // PROFILE
+
 
 static void ServiceInterrupt(CPU *c, WORD service_routine);
 
-void Interrupt_Handle(CPU *c){
-    BYTE requests = Mem_ReadByte(c->memory, IF_ADDR);
-    BYTE enable   = Mem_ReadByte(c->memory, IE_ADDR);
-    if(c->halt && (requests & enable) != 0){
-        c->halt = false;
+void Interrupt_Service(CPU *c){
+    if(c->ei_delay){
+        // The instruction after EI always runs first. EI can't be run
+        // halted, so there's nothing else to do yet
+        c->ei_delay = false;
+        c->IME = true;
+        return;
     }
+    BYTE pending = c->memory->pending;
+    c->halt = false;
     if(c->IME){
-        if(requests != 0 && enable != 0){
-            // If there's an interrupt to handle, handle it and disable further interrupts
-            if(TEST_FLAG(requests, IF_VBLANK) && TEST_FLAG(enable, IF_VBLANK)){
-                requests &= ~(IF_VBLANK); // Clear corresponding flag
-                ServiceInterrupt(c, VBLANK_ROUTINE);
-            }
-            else if(TEST_FLAG(requests, IF_LCD_STAT) && TEST_FLAG(enable, IF_LCD_STAT)){
-                requests &= ~(IF_LCD_STAT); // Clear corresponding flag
-                ServiceInterrupt(c, LCD_STAT_ROUTINE);
-            }
-            else if(TEST_FLAG(requests, IF_TIMER) && TEST_FLAG(enable, IF_TIMER)){
-                requests &= ~(IF_TIMER); // Clear corresponding flag
-                ServiceInterrupt(c, TIMER_ROUTINE);
-            }
-            else if(TEST_FLAG(requests, IF_JOYPAD) && TEST_FLAG(enable, IF_JOYPAD)){
-                requests &= ~(IF_JOYPAD); // Clear corresponding flag
-                ServiceInterrupt(c, JOYPAD_ROUTINE);
-            }
+        // If there's an interrupt to handle, handle it and disable further
+        // interrupts. The lowest bit goes first
+        BYTE requests = Mem_ReadByte(c->memory, IF_ADDR);
+        if(TEST_FLAG(pending, IF_VBLANK)){
+            Mem_WriteByte(c->memory, IF_ADDR, requests & ~(IF_VBLANK)); // Clear corresponding flag
+            ServiceInterrupt(c, VBLANK_ROUTINE);
+        }
+        else if(TEST_FLAG(pending, IF_LCD_STAT)){
+            Mem_WriteByte(c->memory, IF_ADDR, requests & ~(IF_LCD_STAT));
+            ServiceInterrupt(c, LCD_STAT_ROUTINE);
+        }
+        else if(TEST_FLAG(pending, IF_TIMER)){
+            Mem_WriteByte(c->memory, IF_ADDR, requests & ~(IF_TIMER));
+            ServiceInterrupt(c, TIMER_ROUTINE);
+        }
+        else if(TEST_FLAG(pending, IF_SERIAL)){
+            Mem_WriteByte(c->memory, IF_ADDR, requests & ~(IF_SERIAL));
+            ServiceInterrupt(c, SERIAL_ROUTINE);
+        }
+        else{
+            Mem_WriteByte(c->memory, IF_ADDR, requests & ~(IF_JOYPAD));
+            ServiceInterrupt(c, JOYPAD_ROUTINE);
         }
-        Mem_WriteByte(c->memory, IF_ADDR, requests);
     }
 }
 
@@ -42,4 +53,7 @@ static void ServiceInterrupt(CPU *c, WORD service_routine){
     c->pc = service_routine;
     c->cycles += 3 * 4;
     c->IME = false;
+#ifdef PROFILE
+    Profiler_RecordInterrupt(c);
+#endif // PROFILE
 }
\ No newline at end of file
@@ -1,8 +1,12 @@
 #include "memory.h"
+#include "timer.h"
+#include "graphics.h"
+#include "audio.h"
 
 #include <stdlib.h>
 #include <string.h>
 
+static void UpdatePending(MEMORY *mem);
 
 MEMORY *Mem_Create(){
     MEMORY *memory = malloc(sizeof(MEMORY));
@@ -49,13 +53,8 @@ void Mem_Startup(MEMORY *mem){
         Mem_ForceWrite(mem, 0xFF24, 0x77); // NR50
         Mem_ForceWrite(mem, 0xFF25, 0xF3); // NR51
         Mem_ForceWrite(mem, 0xFF26, 0xF1), // NR52
-        Mem_ForceWrite(mem, 0xFF40, 0x91); // LCDC
         Mem_ForceWrite(mem, 0xFF42, 0x00); // SCY
         Mem_ForceWrite(mem, 0xFF43, 0x00); // SCX
-        Mem_ForceWrite(mem, 0xFF45, 0x00); // LYC
-        Mem_ForceWrite(mem, 0xFF47, 0xFC); // BGP
-        Mem_ForceWrite(mem, 0xFF48, 0xFF); // OBP0
-        Mem_ForceWrite(mem, 0xFF49, 0xFF); // OBP1
         Mem_ForceWrite(mem, 0xFF4A, 0x00); // WY
         Mem_ForceWrite(mem, 0xFF4B, 0x00); // WX
         Mem_ForceWrite(mem, 0xFFFF, 0x00); // IE
@@ -73,6 +72,18 @@ void Mem_SetJoypad(MEMORY *mem, JOYPAD *j){
     mem->joypad = j;
 }
 
+void Mem_SetTimer(MEMORY *mem, TIMER *t){
+    mem->timer = t;
+}
+
+void Mem_SetGraphics(MEMORY *mem, GRAPHICS *g){
+    mem->graphics = g;
+}
+
+void Mem_SetAPU(MEMORY *mem, APU *a){
+    mem->apu = a;
+}
+
 void Mem_WriteByte(MEMORY *mem, WORD addr, BYTE data){
     switch(Mem_GetRegion(mem, addr)){
         case ROM0:
@@ -83,14 +94,22 @@ void Mem_WriteByte(MEMORY *mem, WORD addr, BYTE data){
             Cartridge_WriteRAM(mem->cartridge, addr, data);
             break;
         case VRAM:
+            // Lines still waiting to be drawn need the old contents
+            Graphics_FlushLines(mem->graphics);
             mem->vram[addr - 0x8000] = data;
             break;
+        case OAM:
+            Graphics_FlushLines(mem->graphics);
+            mem->mem[addr - 0xC000] = data;
+            break;
         case WRAM0:
         case WRAMX:
-        case OAM:
         case HRAM:
+            mem->mem[addr - 0xC000] = data;
+            break;
         case IE:
             mem->mem[addr - 0xC000] = data;
+            UpdatePending(mem);
             break;
         case IO:
             switch(addr){
@@ -98,17 +117,41 @@ void Mem_WriteByte(MEMORY *mem, WORD addr, BYTE data){
                     // Don't write the lower 4 bits
                     mem->mem[addr - 0xC000] = data & 0xF0;
                     break;
+                case IF_ADDR:
+                    mem->mem[addr - 0xC000] = data;
+                    UpdatePending(mem);
+                    break;
                 case DIV_ADDR:
+                case TIMA_ADDR:
+                case TMA_ADDR:
+                case TAC_ADDR:
+                    Timer_WriteRegister(mem->timer, addr, data);
+                    break;
+                case LCDC_ADDR:
+                case STAT_ADDR:
                 case LY_ADDR:
-                    mem->mem[addr - 0xC000] = 0;
+                case LYC_ADDR:
+                case BGP_ADDR:
+                case OBP0_ADDR:
+                case OBP1_ADDR:
+                    Graphics_WriteRegister(mem->graphics, addr, data);
                     break;
-                case TAC_ADDR: // Write first 3 bits only
-                    mem->mem[addr - 0xC000] = data & 0x07;
+                case SCY_ADDR:
+                case SCX_ADDR:
+                case WY_ADDR:
+                case WX_ADDR:
+                    // The pixel FIFO has to see the old value up to now
+                    Graphics_CatchUp(mem->graphics);
+                    mem->mem[addr - 0xC000] = data;
                     break;
                 case DMA_ADDR:
                     Mem_DMATransfer(mem, data);
                     break;
                 default:
+                    if(addr >= NR10_ADDR && addr < NR10_ADDR + APU_REGISTERS){
+                        // The APU has to run up to now with the old value
+                        APU_WriteRegister(mem->apu, addr, data);
+                    }
                     mem->mem[addr - 0xC000] = data;
             };
             break;
@@ -127,6 +170,7 @@ void Mem_WriteWord(MEMORY *mem, WORD addr, WORD data){
 
 void Mem_DMATransfer(MEMORY *mem, BYTE data){
     WORD src = data << 8;
+    Graphics_FlushLines(mem->graphics);
     for(int i = 0; i < 0xA0; i++){
         // $FE00 - $C000 = $3E00
         mem->mem[0x3E00 + i] = Mem_ReadByte(mem, src + i);
@@ -158,11 +202,25 @@ BYTE Mem_ReadByte(MEMORY *mem, WORD addr){
             switch(addr){
                 case P1_ADDR:
                     return Joypad_GetState(mem->joypad, mem->mem[addr - 0xC000]);
+                case DIV_ADDR:
+                case TIMA_ADDR:
+                case TMA_ADDR:
                 case TAC_ADDR:
-                    return mem->mem[addr - 0xC000] & 0x07;
+                    return Timer_ReadRegister(mem->timer, addr);
                 case IF_ADDR:
                     return mem->mem[addr - 0xC000] | 0xE0;
+                case LCDC_ADDR:
+                case STAT_ADDR:
+                case LY_ADDR:
+                case LYC_ADDR:
+                case BGP_ADDR:
+                case OBP0_ADDR:
+                case OBP1_ADDR:
+                    return Graphics_ReadRegister(mem->graphics, addr);
                 default:
+                    if(addr >= NR10_ADDR && addr < NR10_ADDR + APU_REGISTERS){
+                        return APU_ReadRegister(mem->apu, addr);
+                    }
                     return mem->mem[addr - 0xC000];
             };
         default:
@@ -176,14 +234,17 @@ WORD Mem_ReadWord(MEMORY *mem, WORD addr){
 
 void Mem_RequestInterrupt(MEMORY *mem, BYTE interrupt){
     mem->mem[0xFF0F - 0xC000] |= interrupt;
+    UpdatePending(mem);
 }
 
 void Mem_EnableInterrupt(MEMORY *mem, BYTE interrupt){
     mem->mem[0xFFFF - 0xC000] |= interrupt; 
+    UpdatePending(mem);
 }
 
 void Mem_DisableInterrupt(MEMORY *mem, BYTE interrupt){
     mem->mem[0xFFFF - 0xC000] &= ~(interrupt);
+    UpdatePending(mem);
 }
 
 MEM_REGION Mem_GetRegion(MEMORY *mem, WORD addr){
@@ -226,8 +287,15 @@ void Mem_ForceWrite(MEMORY *mem, WORD addr, BYTE data){
         case IE:
         case IO:
             mem->mem[addr - 0xC000] = data;
+            if(addr == IF_ADDR || addr == IE_ADDR)
+                UpdatePending(mem);
             break;
         default:
             break;
     };
-}
\ No newline at end of file
+}
+
+// Only the 5 interrupts' bits count
+static void UpdatePending(MEMORY *mem){
+    mem->pending = mem->mem[IF_ADDR - 0xC000] & mem->mem[IE_ADDR - 0xC000] & 0x1F;
+}
@@ -0,0 +1,140 @@
+#include "recorder.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define WAV_HEADER_SIZE 44
+
+// Samples converted and written at a time
+#define RECORD_CHUNK 1024
+
+static void WriteHeader(RECORDER *r);
+static void WriteSamples(RECORDER *r, int16_t samples[][2], int count);
+static void WriteLevels(RECORDER *r, unsigned int time);
+static void PutLE(BYTE *out, unsigned int value, int bytes);
+
+
+RECORDER *Recorder_Create(const char *path, RECORD_FORMAT format, int rate){
+    RECORDER *recorder = malloc(sizeof(RECORDER));
+    if(recorder == NULL)
+        return NULL;
+    memset(recorder, 0, sizeof(RECORDER));
+    recorder->format = format;
+    if(rate != RECORD_NATIVE_RATE){
+        if(rate < 1)
+            rate = 1;
+        if(rate > RECORD_MAX_RATE)
+            rate = RECORD_MAX_RATE;
+        if((recorder->blip = Blip_Create()) == NULL){
+            Recorder_Destroy(recorder);
+            return NULL;
+        }
+        Blip_SetRates(recorder->blip, CLK_F, rate);
+    }
+    recorder->rate = rate;
+
+    recorder->file = fopen(path, "wb");
+    if(recorder->file == NULL){
+        printf("Unable to open %s for recording.\n", path);
+        Recorder_Destroy(recorder);
+        return NULL;
+    }
+    // The sizes in the header are filled in at the end
+    if(format == RECORD_WAV)
+        WriteHeader(recorder);
+    return recorder;
+}
+
+void Recorder_Destroy(RECORDER *r){
+    if(r != NULL){
+        if(r->file != NULL){
+            if(r->format == RECORD_WAV && fseek(r->file, 0, SEEK_SET) == 0)
+                WriteHeader(r);
+            fclose(r->file);
+        }
+        Blip_Destroy(r->blip);
+        free(r);
+    }
+}
+
+void Recorder_Change(RECORDER *r, unsigned int time, const int level[2]){
+    if(r->blip == NULL){
+        // Everything up to now was at the old levels
+        WriteLevels(r, time);
+    }
+    else{
+        Blip_AddDelta(r->blip, time, level[0] - r->level[0], level[1] - r->level[1]);
+    }
+    r->level[0] = level[0];
+    r->level[1] = level[1];
+}
+
+void Recorder_EndFrame(RECORDER *r, unsigned int time){
+    if(r->blip == NULL){
+        WriteLevels(r, time);
+        r->time -= time;
+    }
+    else{
+        int16_t samples[BLIP_BUFFER_SIZE][2];
+        Blip_EndFrame(r->blip, time);
+        int count = Blip_ReadSamples(r->blip, samples, BLIP_BUFFER_SIZE);
+        WriteSamples(r, samples, count);
+    }
+}
+
+// Native rate: writes a sample at the current levels for every machine
+// cycle from r->time up to time
+static void WriteLevels(RECORDER *r, unsigned int time){
+    int16_t samples[RECORD_CHUNK][2];
+    while(r->time < time){
+        int count = (time - r->time + 3) / 4;
+        if(count > RECORD_CHUNK)
+            count = RECORD_CHUNK;
+        for(int i = 0; i < count; i++){
+            samples[i][0] = r->level[0];
+            samples[i][1] = r->level[1];
+        }
+        WriteSamples(r, samples, count);
+        r->time += count * 4;
+    }
+}
+
+static void WriteSamples(RECORDER *r, int16_t samples[][2], int count){
+    BYTE bytes[RECORD_CHUNK * 4];
+    for(int start = 0; start < count; start += RECORD_CHUNK){
+        int n = (count - start < RECORD_CHUNK) ? count - start : RECORD_CHUNK;
+        for(int i = 0; i < n; i++){
+            PutLE(bytes + i * 4, (WORD) samples[start + i][0], 2);
+            PutLE(bytes + i * 4 + 2, (WORD) samples[start + i][1], 2);
+        }
+        fwrite(bytes, 4, n, r->file);
+    }
+    r->samples += count;
+}
+
+// A canonical 44 byte PCM header. Sizes past 4 GB are cut off
+static void WriteHeader(RECORDER *r){
+    BYTE header[WAV_HEADER_SIZE];
+    unsigned long long data_size = r->samples * 4;
+    if(data_size > 0xFFFFFFFFULL - (WAV_HEADER_SIZE - 8))
+        data_size = 0xFFFFFFFFULL - (WAV_HEADER_SIZE - 8);
+    memcpy(header, "RIFF", 4);
+    PutLE(header + 4, (unsigned int) data_size + WAV_HEADER_SIZE - 8, 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    PutLE(header + 16, 16, 4);           // Size of the fmt chunk
+    PutLE(header + 20, 1, 2);            // PCM
+    PutLE(header + 22, 2, 2);            // Channels
+    PutLE(header + 24, r->rate, 4);
+    PutLE(header + 28, r->rate * 4, 4);  // Bytes per second
+    PutLE(header + 32, 4, 2);            // Bytes per sample, both channels
+    PutLE(header + 34, 16, 2);           // Bits per channel
+    memcpy(header + 36, "data", 4);
+    PutLE(header + 40, (unsigned int) data_size, 4);
+    fwrite(header, 1, WAV_HEADER_SIZE, r->file);
+}
+
+static void PutLE(BYTE *out, unsigned int value, int bytes){
+    for(int i = 0; i < bytes; i++){
+        out[i] = (value >> (i * 8)) & 0xFF;
+    }
+}
@@ -0,0 +1,501 @@
+#include "scaler.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define INPUT_PITCH (SCREEN_WIDTH + 2 * SCALER_BORDER)
+
+// Scales line y of s->input into the s->scale rows starting at out
+typedef void (*SCALE_LINE)(const SCALER *s, int y, PIXEL *out);
+
+static const char *scaler_names[SCALER_COUNT] = {
+    "Nearest", "Scale2x", "Scale3x", "HQ2x", "xBR 2x"
+};
+
+// Output pixels per frame pixel, when it isn't up to the caller
+static const int scaler_scales[SCALER_COUNT] = {0, 2, 3, 2, 2};
+
+// Lines of the frame each output line looks at, above and below its own
+static const int scaler_reach[SCALER_COUNT] = {0, 1, 1, 1, 2};
+
+static void Nearest_C(const SCALER *s, int y, PIXEL *out);
+static void Scale2x_C(const SCALER *s, int y, PIXEL *out);
+static void Scale3x_C(const SCALER *s, int y, PIXEL *out);
+static void HQ2x_C(const SCALER *s, int y, PIXEL *out);
+static void XBR2x_C(const SCALER *s, int y, PIXEL *out);
+
+static const SCALE_LINE reference_lines[SCALER_COUNT] = {
+    Nearest_C, Scale2x_C, Scale3x_C, HQ2x_C, XBR2x_C
+};
+
+#if defined(__SSE2__)
+static void Nearest_SIMD(const SCALER *s, int y, PIXEL *out);
+static void Scale2x_SIMD(const SCALER *s, int y, PIXEL *out);
+static void Scale3x_SIMD(const SCALER *s, int y, PIXEL *out);
+
+static const SCALE_LINE scale_lines[SCALER_COUNT] = {
+    Nearest_SIMD, Scale2x_SIMD, Scale3x_SIMD, HQ2x_C, XBR2x_C
+};
+#else
+#define scale_lines reference_lines
+#endif
+
+
+SCALER *Scaler_Create(SCALER_TYPE type, int scale){
+    if(type == SCALER_NEAREST && (scale < 1 || scale > MAX_SCALE)){
+        return NULL;
+    }
+    SCALER *scaler = malloc(sizeof(SCALER));
+    if(scaler != NULL){
+        memset(scaler, 0, sizeof(SCALER));
+        scaler->type = type;
+        scaler->scale = (type == SCALER_NEAREST) ? scale : scaler_scales[type];
+        scaler->width = SCREEN_WIDTH * scaler->scale;
+        scaler->height = SCREEN_HEIGHT * scaler->scale;
+        scaler->pixels = malloc(scaler->width * scaler->height * sizeof(PIXEL));
+        if(scaler->pixels == NULL){
+            Scaler_Destroy(scaler);
+            scaler = NULL;
+        }
+    }
+    return scaler;
+}
+
+void Scaler_Destroy(SCALER *s){
+    if(s != NULL){
+        free(s->pixels);
+        free(s);
+    }
+}
+
+const char *Scaler_Name(SCALER_TYPE type){
+    return scaler_names[type];
+}
+
+// Copies line y of the frame into s->input, repeating the pixels at the edges
+static void CopyLine(SCALER *s, PIXEL frame[SCREEN_HEIGHT][SCREEN_WIDTH], int y){
+    int first = y + SCALER_BORDER;
+    int last = first;
+    // The top and bottom lines are repeated too
+    if(y == 0)
+        first = 0;
+    if(y == SCREEN_HEIGHT - 1)
+        last = SCREEN_HEIGHT + 2 * SCALER_BORDER - 1;
+    for(int row = first; row <= last; row++){
+        PIXEL *in = s->input[row];
+        memcpy(in + SCALER_BORDER, frame[y], sizeof(frame[y]));
+        for(int i = 0; i < SCALER_BORDER; i++){
+            in[i] = frame[y][0];
+            in[SCALER_BORDER + SCREEN_WIDTH + i] = frame[y][SCREEN_WIDTH - 1];
+        }
+    }
+}
+
+void Scaler_Scale(SCALER *s, PIXEL frame[SCREEN_HEIGHT][SCREEN_WIDTH], const LINE_MASK *changed, LINE_MASK *scaled){
+    const SCALE_LINE scale_line = s->reference ? reference_lines[s->type] : scale_lines[s->type];
+    int reach = scaler_reach[s->type];
+    LINE_MASK lines;
+    memset(&lines, 0, sizeof(LINE_MASK));
+
+    for(int y = 0; y < SCREEN_HEIGHT; y++){
+        if(!LINE_MASK_TEST(changed, y))
+            continue;
+        CopyLine(s, frame, y);
+        // Every line that looks at this one has to be scaled again
+        for(int near = y - reach; near <= y + reach; near++){
+            if(near >= 0 && near < SCREEN_HEIGHT)
+                lines.bits[near / 64] |= (uint64_t) 1 << (near % 64);
+        }
+    }
+    for(int y = 0; y < SCREEN_HEIGHT; y++){
+        if(LINE_MASK_TEST(&lines, y))
+            scale_line(s, y, s->pixels + y * s->scale * s->width);
+    }
+    if(scaled != NULL)
+        *scaled = lines;
+}
+
+
+/**
+ * Plain C versions. These are also the reference the SIMD versions have to
+ * match exactly.
+ */
+
+static void Nearest_C(const SCALER *s, int y, PIXEL *out){
+    const PIXEL *in = &s->input[y + SCALER_BORDER][SCALER_BORDER];
+    for(int x = 0; x < SCREEN_WIDTH; x++){
+        for(int i = 0; i < s->scale; i++){
+            out[x * s->scale + i] = in[x];
+        }
+    }
+    // The other rows are the same as the first
+    for(int row = 1; row < s->scale; row++){
+        memcpy(out + row * s->width, out, s->width * sizeof(PIXEL));
+    }
+}
+
+static inline bool Same(PIXEL a, PIXEL b){
+    return a.color == b.color;
+}
+
+/**
+ * Scale2x splits each pixel E into 4, looking at the pixels around it:
+ *   A B C
+ *   D E F
+ *   G H I
+ * Where two neighbours that meet at a corner match, and the other two
+ * don't, there's an edge cutting across that corner and it takes their color.
+ */
+static void Scale2x_C(const SCALER *s, int y, PIXEL *out){
+    const PIXEL *in = &s->input[y + SCALER_BORDER][SCALER_BORDER];
+    PIXEL *out0 = out;
+    PIXEL *out1 = out + s->width;
+    for(int x = 0; x < SCREEN_WIDTH; x++){
+        PIXEL b = in[x - INPUT_PITCH], d = in[x - 1], e = in[x], f = in[x + 1], h = in[x + INPUT_PITCH];
+        if(!Same(b, h) && !Same(d, f)){
+            out0[x * 2]     = Same(d, b) ? d : e;
+            out0[x * 2 + 1] = Same(b, f) ? f : e;
+            out1[x * 2]     = Same(d, h) ? d : e;
+            out1[x * 2 + 1] = Same(h, f) ? f : e;
+        }
+        else{
+            out0[x * 2] = out0[x * 2 + 1] = out1[x * 2] = out1[x * 2 + 1] = e;
+        }
+    }
+}
+
+// Scale3x works the same way, with the middle of each side also looking at
+// the corners next to it
+static void Scale3x_C(const SCALER *s, int y, PIXEL *out){
+    const PIXEL *in = &s->input[y + SCALER_BORDER][SCALER_BORDER];
+    PIXEL *out0 = out;
+    PIXEL *out1 = out + s->width;
+    PIXEL *out2 = out + s->width * 2;
+    for(int x = 0; x < SCREEN_WIDTH; x++){
+        PIXEL a = in[x - INPUT_PITCH - 1], b = in[x - INPUT_PITCH], c = in[x - INPUT_PITCH + 1];
+        PIXEL d = in[x - 1], e = in[x], f = in[x + 1];
+        PIXEL g = in[x + INPUT_PITCH - 1], h = in[x + INPUT_PITCH], i = in[x + INPUT_PITCH + 1];
+        PIXEL *o0 = out0 + x * 3, *o1 = out1 + x * 3, *o2 = out2 + x * 3;
+        if(!Same(b, h) && !Same(d, f)){
+            o0[0] = Same(d, b) ? d : e;
+            o0[1] = ((Same(d, b) && !Same(e, c)) || (Same(b, f) && !Same(e, a))) ? b : e;
+            o0[2] = Same(b, f) ? f : e;
+            o1[0] = ((Same(d, b) && !Same(e, g)) || (Same(d, h) && !Same(e, a))) ? d : e;
+            o1[1] = e;
+            o1[2] = ((Same(b, f) && !Same(e, i)) || (Same(h, f) && !Same(e, c))) ? f : e;
+            o2[0] = Same(d, h) ? d : e;
+            o2[1] = ((Same(d, h) && !Same(e, i)) || (Same(h, f) && !Same(e, g))) ? h : e;
+            o2[2] = Same(h, f) ? f : e;
+        }
+        else{
+            o0[0] = o0[1] = o0[2] = o1[0] = o1[1] = o1[2] = o2[0] = o2[1] = o2[2] = e;
+        }
+    }
+}
+
+// PIXEL.color is 0xRRGGBBAA
+typedef struct{
+    int y, u, v;
+} YUV;
+
+static inline YUV ToYUV(PIXEL p){
+    YUV yuv;
+    yuv.y = (p.r * 77 + p.g * 150 + p.b * 29) >> 8;
+    yuv.u = (-p.r * 43 - p.g * 85 + p.b * 128) >> 8;
+    yuv.v = (p.r * 128 - p.g * 107 - p.b * 21) >> 8;
+    return yuv;
+}
+
+// Whether two colors are far enough apart for HQ2x to see an edge between them
+static inline bool Differ(PIXEL a, PIXEL b){
+    if(Same(a, b))
+        return false;
+    YUV x = ToYUV(a), y = ToYUV(b);
+    return abs(x.y - y.y) > 48 || abs(x.u - y.u) > 7 || abs(x.v - y.v) > 6;
+}
+
+// How far apart two colors look, for xBR
+static inline int Distance(PIXEL a, PIXEL b){
+    if(Same(a, b))
+        return 0;
+    YUV x = ToYUV(a), y = ToYUV(b);
+    return 48 * abs(x.y - y.y) + 7 * abs(x.u - y.u) + 6 * abs(x.v - y.v);
+}
+
+// Per channel (a * wa + b * wb + c * wc) / 4, with the weights adding up to 4
+static inline PIXEL Mix(PIXEL a, int wa, PIXEL b, int wb, PIXEL c, int wc){
+    const unsigned int even = 0x00FF00FF;
+    unsigned int low = ((a.color & even) * wa + (b.color & even) * wb + (c.color & even) * wc) >> 2;
+    unsigned int high = (((a.color >> 8) & even) * wa + ((b.color >> 8) & even) * wb + ((c.color >> 8) & even) * wc) >> 2;
+    PIXEL p;
+    p.color = (low & even) | ((high & even) << 8);
+    return p;
+}
+
+/**
+ * A cut down HQ2x. Each corner of E looks at the side neighbours it touches
+ * (side_a and side_b) and the diagonal one between them, comparing colors in
+ * YUV with HQ2x's thresholds. If both sides match each other but not E, an
+ * edge runs across the corner and it's blended from all three. If only the
+ * diagonal differs from E, it's blended in a little to round off the corner.
+ * The real HQ2x tells apart 256 patterns of all 8 neighbours.
+ */
+static inline PIXEL HQ2xCorner(PIXEL e, PIXEL side_a, PIXEL side_b, PIXEL diagonal){
+    if(!Differ(side_a, side_b) && Differ(e, side_a)){
+        return Mix(e, 2, side_a, 1, side_b, 1);
+    }
+    if(Differ(e, diagonal) && !Differ(e, side_a) && !Differ(e, side_b)){
+        return Mix(e, 3, diagonal, 1, diagonal, 0);
+    }
+    return e;
+}
+
+static void HQ2x_C(const SCALER *s, int y, PIXEL *out){
+    const PIXEL *in = &s->input[y + SCALER_BORDER][SCALER_BORDER];
+    PIXEL *out0 = out;
+    PIXEL *out1 = out + s->width;
+    for(int x = 0; x < SCREEN_WIDTH; x++){
+        PIXEL a = in[x - INPUT_PITCH - 1], b = in[x - INPUT_PITCH], c = in[x - INPUT_PITCH + 1];
+        PIXEL d = in[x - 1], e = in[x], f = in[x + 1];
+        PIXEL g = in[x + INPUT_PITCH - 1], h = in[x + INPUT_PITCH], i = in[x + INPUT_PITCH + 1];
+        out0[x * 2]     = HQ2xCorner(e, b, d, a);
+        out0[x * 2 + 1] = HQ2xCorner(e, b, f, c);
+        out1[x * 2]     = HQ2xCorner(e, h, d, g);
+        out1[x * 2 + 1] = HQ2xCorner(e, h, f, i);
+    }
+}
+
+/**
+ * 2xBR, the first level of xBR. For the corner of E between F and H, it
+ * weighs up how strongly the area around it runs along each diagonal:
+ *         B
+ *      D  E  F  F4
+ *         H  I  I4
+ *         H5 I5
+ * (plus C and G at the ends of the other diagonal). If the edge runs along
+ * F-H rather than E-I, the corner is blended halfway towards whichever of F
+ * and H is closer to E. right and down are the offsets to F and H, so the
+ * same code handles every corner by flipping them.
+ */
+static inline PIXEL XBRCorner(const PIXEL *e, int right, int down){
+    PIXEL E = e[0], F = e[right], H = e[down];
+    if(Same(E, F) || Same(E, H))
+        return E;
+    PIXEL B = e[-down], C = e[right - down], D = e[-right], G = e[down - right], I = e[right + down];
+    PIXEL F4 = e[2 * right], I4 = e[2 * right + down], H5 = e[2 * down], I5 = e[right + 2 * down];
+    int along = Distance(E, C) + Distance(E, G) + Distance(I, F4) + Distance(I, H5) + 4 * Distance(H, F);
+    int across = Distance(H, D) + Distance(H, I5) + Distance(F, I4) + Distance(F, B) + 4 * Distance(E, I);
+    if(along >= across)
+        return E;
+    PIXEL closer = (Distance(E, F) <= Distance(E, H)) ? F : H;
+    return Mix(E, 2, closer, 2, closer, 0);
+}
+
+static void XBR2x_C(const SCALER *s, int y, PIXEL *out){
+    const PIXEL *in = &s->input[y + SCALER_BORDER][SCALER_BORDER];
+    PIXEL *out0 = out;
+    PIXEL *out1 = out + s->width;
+    for(int x = 0; x < SCREEN_WIDTH; x++){
+        out0[x * 2]     = XBRCorner(in + x, -1, -INPUT_PITCH);
+        out0[x * 2 + 1] = XBRCorner(in + x, 1, -INPUT_PITCH);
+        out1[x * 2]     = XBRCorner(in + x, -1, INPUT_PITCH);
+        out1[x * 2 + 1] = XBRCorner(in + x, 1, INPUT_PITCH);
+    }
+}
+
+
+/**
+ * SIMD versions. A VECTOR holds 4 (SSE2) or 8 (AVX2) pixels, and the code
+ * above is done on all of them at once, with masks in place of the ifs.
+ */
+#if defined(__SSE2__)
+
+#if defined(__AVX2__)
+typedef __m256i VECTOR;
+#define VECTOR_PIXELS 8
+
+static inline VECTOR Load(const PIXEL *p){ return _mm256_loadu_si256((const __m256i *) p); }
+static inline void Store(PIXEL *p, VECTOR v){ _mm256_storeu_si256((__m256i *) p, v); }
+static inline VECTOR Equal(VECTOR a, VECTOR b){ return _mm256_cmpeq_epi32(a, b); }
+static inline VECTOR And(VECTOR a, VECTOR b){ return _mm256_and_si256(a, b); }
+static inline VECTOR Or(VECTOR a, VECTOR b){ return _mm256_or_si256(a, b); }
+static inline VECTOR AndNot(VECTOR a, VECTOR b){ return _mm256_andnot_si256(a, b); } // ~a & b
+static inline VECTOR Select(VECTOR mask, VECTOR a, VECTOR b){ return _mm256_blendv_epi8(b, a, mask); }
+
+// lo and hi get a0 b0 a1 b1 ... in order. The unpacks work within each
+// 128 bit half, so the halves are put back in order after
+static inline void Zip(VECTOR a, VECTOR b, VECTOR *lo, VECTOR *hi){
+    VECTOR l = _mm256_unpacklo_epi32(a, b);
+    VECTOR h = _mm256_unpackhi_epi32(a, b);
+    *lo = _mm256_permute2x128_si256(l, h, 0x20);
+    *hi = _mm256_permute2x128_si256(l, h, 0x31);
+}
+
+// Stores a0 b0 c0 a1 b1 c1 ...
+static inline void Store3(PIXEL *p, VECTOR a, VECTOR b, VECTOR c){
+    __m256 ab_lo = _mm256_castsi256_ps(_mm256_unpacklo_epi32(a, b));  // a0 b0 a1 b1
+    __m256 ab_hi = _mm256_castsi256_ps(_mm256_unpackhi_epi32(a, b));  // a2 b2 a3 b3
+    __m256 ca_lo = _mm256_castsi256_ps(_mm256_unpacklo_epi32(c, a));  // c0 a0 c1 a1
+    __m256 ca_hi = _mm256_castsi256_ps(_mm256_unpackhi_epi32(c, a));  // c2 a2 c3 a3
+    __m256 bc_lo = _mm256_castsi256_ps(_mm256_unpacklo_epi32(b, c));  // b0 c0 b1 c1
+    __m256 bc_hi = _mm256_castsi256_ps(_mm256_unpackhi_epi32(b, c));  // b2 c2 b3 c3
+    VECTOR r0 = _mm256_castps_si256(_mm256_shuffle_ps(ab_lo, ca_lo, _MM_SHUFFLE(3, 0, 1, 0))); // a0 b0 c0 a1
+    VECTOR r1 = _mm256_castps_si256(_mm256_shuffle_ps(bc_lo, ab_hi, _MM_SHUFFLE(1, 0, 3, 2))); // b1 c1 a2 b2
+    VECTOR r2 = _mm256_castps_si256(_mm256_shuffle_ps(ca_hi, bc_hi, _MM_SHUFFLE(3, 2, 3, 0))); // c2 a3 b3 c3
+    // Each half did its own 4 pixels
+    Store(p, _mm256_permute2x128_si256(r0, r1, 0x20));
+    Store(p + 8, _mm256_permute2x128_si256(r2, r0, 0x30));
+    Store(p + 16, _mm256_permute2x128_si256(r1, r2, 0x31));
+}
+#else
+typedef __m128i VECTOR;
+#define VECTOR_PIXELS 4
+
+static inline VECTOR Load(const PIXEL *p){ return _mm_loadu_si128((const __m128i *) p); }
+static inline void Store(PIXEL *p, VECTOR v){ _mm_storeu_si128((__m128i *) p, v); }
+static inline VECTOR Equal(VECTOR a, VECTOR b){ return _mm_cmpeq_epi32(a, b); }
+static inline VECTOR And(VECTOR a, VECTOR b){ return _mm_and_si128(a, b); }
+static inline VECTOR Or(VECTOR a, VECTOR b){ return _mm_or_si128(a, b); }
+static inline VECTOR AndNot(VECTOR a, VECTOR b){ return _mm_andnot_si128(a, b); } // ~a & b
+static inline VECTOR Select(VECTOR mask, VECTOR a, VECTOR b){ return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b)); }
+
+// lo and hi get a0 b0 a1 b1 ... in order
+static inline void Zip(VECTOR a, VECTOR b, VECTOR *lo, VECTOR *hi){
+    *lo = _mm_unpacklo_epi32(a, b);
+    *hi = _mm_unpackhi_epi32(a, b);
+}
+
+// Stores a0 b0 c0 a1 b1 c1 ...
+static inline void Store3(PIXEL *p, VECTOR a, VECTOR b, VECTOR c){
+    __m128 ab_lo = _mm_castsi128_ps(_mm_unpacklo_epi32(a, b));  // a0 b0 a1 b1
+    __m128 ab_hi = _mm_castsi128_ps(_mm_unpackhi_epi32(a, b));  // a2 b2 a3 b3
+    __m128 ca_lo = _mm_castsi128_ps(_mm_unpacklo_epi32(c, a));  // c0 a0 c1 a1
+    __m128 ca_hi = _mm_castsi128_ps(_mm_unpackhi_epi32(c, a));  // c2 a2 c3 a3
+    __m128 bc_lo = _mm_castsi128_ps(_mm_unpacklo_epi32(b, c));  // b0 c0 b1 c1
+    __m128 bc_hi = _mm_castsi128_ps(_mm_unpackhi_epi32(b, c));  // b2 c2 b3 c3
+    Store(p, _mm_castps_si128(_mm_shuffle_ps(ab_lo, ca_lo, _MM_SHUFFLE(3, 0, 1, 0))));     // a0 b0 c0 a1
+    Store(p + 4, _mm_castps_si128(_mm_shuffle_ps(bc_lo, ab_hi, _MM_SHUFFLE(1, 0, 3, 2)))); // b1 c1 a2 b2
+    Store(p + 8, _mm_castps_si128(_mm_shuffle_ps(ca_hi, bc_hi, _MM_SHUFFLE(3, 2, 3, 0)))); // c2 a3 b3 c3
+}
+#endif
+
+static inline void Store2(PIXEL *p, VECTOR a, VECTOR b){
+    VECTOR lo, hi;
+    Zip(a, b, &lo, &hi);
+    Store(p, lo);
+    Store(p + VECTOR_PIXELS, hi);
+}
+
+static void Nearest_SIMD(const SCALER *s, int y, PIXEL *out){
+    const PIXEL *in = &s->input[y + SCALER_BORDER][SCALER_BORDER];
+    for(int x = 0; x < SCREEN_WIDTH; x += VECTOR_PIXELS){
+        VECTOR v = Load(in + x);
+        PIXEL *o = out + x * s->scale;
+        switch(s->scale){
+            case 1:
+                Store(o, v);
+                break;
+            case 2:
+                Store2(o, v, v);
+                break;
+            case 3:
+                Store3(o, v, v, v);
+                break;
+            case 4:{
+                VECTOR lo, hi;
+                Zip(v, v, &lo, &hi);
+                Store2(o, lo, lo);
+                Store2(o + VECTOR_PIXELS * 2, hi, hi);
+                break;
+            }
+        }
+    }
+    for(int row = 1; row < s->scale; row++){
+        memcpy(out + row * s->width, out, s->width * sizeof(PIXEL));
+    }
+}
+
+static void Scale2x_SIMD(const SCALER *s, int y, PIXEL *out){
+    const PIXEL *in = &s->input[y + SCALER_BORDER][SCALER_BORDER];
+    PIXEL *out0 = out;
+    PIXEL *out1 = out + s->width;
+    for(int x = 0; x < SCREEN_WIDTH; x += VECTOR_PIXELS){
+        VECTOR b = Load(in + x - INPUT_PITCH), d = Load(in + x - 1), e = Load(in + x);
+        VECTOR f = Load(in + x + 1), h = Load(in + x + INPUT_PITCH);
+        VECTOR edge = AndNot(Or(Equal(b, h), Equal(d, f)), Equal(e, e));
+        VECTOR e0 = Select(And(edge, Equal(d, b)), d, e);
+        VECTOR e1 = Select(And(edge, Equal(b, f)), f, e);
+        VECTOR e2 = Select(And(edge, Equal(d, h)), d, e);
+        VECTOR e3 = Select(And(edge, Equal(h, f)), f, e);
+        Store2(out0 + x * 2, e0, e1);
+        Store2(out1 + x * 2, e2, e3);
+    }
+}
+
+static void Scale3x_SIMD(const SCALER *s, int y, PIXEL *out){
+    const PIXEL *in = &s->input[y + SCALER_BORDER][SCALER_BORDER];
+    PIXEL *out0 = out;
+    PIXEL *out1 = out + s->width;
+    PIXEL *out2 = out + s->width * 2;
+    for(int x = 0; x < SCREEN_WIDTH; x += VECTOR_PIXELS){
+        const PIXEL *p = in + x;
+        VECTOR a = Load(p - INPUT_PITCH - 1), b = Load(p - INPUT_PITCH), c = Load(p - INPUT_PITCH + 1);
+        VECTOR d = Load(p - 1), e = Load(p), f = Load(p + 1);
+        VECTOR g = Load(p + INPUT_PITCH - 1), h = Load(p + INPUT_PITCH), i = Load(p + INPUT_PITCH + 1);
+        VECTOR edge = AndNot(Or(Equal(b, h), Equal(d, f)), Equal(e, e));
+        VECTOR db = And(edge, Equal(d, b)), bf = And(edge, Equal(b, f));
+        VECTOR dh = And(edge, Equal(d, h)), hf = And(edge, Equal(h, f));
+        VECTOR ea = Equal(e, a), ec = Equal(e, c), eg = Equal(e, g), ei = Equal(e, i);
+        Store3(out0 + x * 3, Select(db, d, e),
+                             Select(Or(AndNot(ec, db), AndNot(ea, bf)), b, e),
+                             Select(bf, f, e));
+        Store3(out1 + x * 3, Select(Or(AndNot(eg, db), AndNot(ea, dh)), d, e),
+                             e,
+                             Select(Or(AndNot(ei, bf), AndNot(ec, hf)), f, e));
+        Store3(out2 + x * 3, Select(dh, d, e),
+                             Select(Or(AndNot(ei, dh), AndNot(eg, hf)), h, e),
+                             Select(hf, f, e));
+    }
+}
+#endif // __SSE2__
+
+
+void Scaler_Benchmark(PIXEL frame[SCREEN_HEIGHT][SCREEN_WIDTH], int runs){
+    LINE_MASK all;
+    memset(&all, 0xFF, sizeof(LINE_MASK));
+    printf("%-10s %5s %12s %12s %s\n", "Scaler", "Scale", "us/frame", "C us/frame", "Matches C");
+    for(int type = 0; type < SCALER_COUNT; type++){
+        for(int scale = 2; scale <= (type == SCALER_NEAREST ? MAX_SCALE : 2); scale++){
+            SCALER *fast = Scaler_Create(type, scale);
+            SCALER *reference = Scaler_Create(type, scale);
+            if(fast == NULL || reference == NULL){
+                Scaler_Destroy(fast);
+                Scaler_Destroy(reference);
+                continue;
+            }
+            reference->reference = true;
+            double us[2];
+            SCALER *scalers[2] = {fast, reference};
+            for(int i = 0; i < 2; i++){
+                Uint64 start = SDL_GetPerformanceCounter();
+                for(int run = 0; run < runs; run++){
+                    Scaler_Scale(scalers[i], frame, &all, NULL);
+                }
+                Uint64 ticks = SDL_GetPerformanceCounter() - start;
+                us[i] = ticks * 1000000.0 / SDL_GetPerformanceFrequency() / runs;
+            }
+            bool matches = memcmp(fast->pixels, reference->pixels, fast->width * fast->height * sizeof(PIXEL)) == 0;
+            printf("%-10s %5d %12.1f %12.1f %s\n", Scaler_Name(type), fast->scale, us[0], us[1], matches ? "yes" : "NO");
+            Scaler_Destroy(fast);
+            Scaler_Destroy(reference);
+        }
+    }
+}
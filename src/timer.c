@@ -3,10 +3,19 @@
 #include <stdlib.h>
 #include <string.h>
 
+// The system counter bit TIMA counts the falling edges of, for each TAC
+// clock select: 4096, 262144, 65536 and 16384 Hz
+static const int tac_bits[4] = {9, 3, 5, 7};
+
+static bool Signal(TIMER *t);
+static void Increment(TIMER *t, unsigned int count);
+static void Schedule(TIMER *t);
+
 TIMER *Timer_Create(){
     TIMER *timer = malloc(sizeof(TIMER));
     if(timer != NULL){
         memset(timer, 0, sizeof(TIMER));
+        timer->overflow = TIMER_NEVER;
     }
     return timer;
 }
@@ -23,46 +32,121 @@ void Timer_Destroy(TIMER *t){
     }
 }
 
-void Timer_Update(TIMER *t, unsigned int cycles){
-    t->tima = Mem_ReadByte(t->memory, TIMA_ADDR);
-    t->tma = Mem_ReadByte(t->memory, TMA_ADDR);
-    t->tac = Mem_ReadByte(t->memory, TAC_ADDR);
+void Timer_Startup(TIMER *t){
+    if(t != NULL){
+        // Reading them through memory would just ask the timer
+        t->system_counter = t->memory->mem[DIV_ADDR - 0xC000] << 8;
+        t->tima = t->memory->mem[TIMA_ADDR - 0xC000];
+        t->tma = t->memory->mem[TMA_ADDR - 0xC000];
+        t->tac = t->memory->mem[TAC_ADDR - 0xC000] & 0x07;
+        Schedule(t);
+    }
+}
 
-    if(t->div != Mem_ReadByte(t->memory, DIV_ADDR)){
-        t->system_counter = 0;
+void Timer_SetClock(TIMER *t, const unsigned int *clock){
+    if(t != NULL){
+        t->clock = clock;
+    }
+}
+
+void Timer_CatchUp(TIMER *t){
+    if(t == NULL){
+        return;
+    }
+    unsigned int now = *t->clock;
+    if(now <= t->time){
+        return;
+    }
+    unsigned int cycles = now - t->time;
+    if(TEST_BIT(t->tac, 2)){
+        // A falling edge every time the counter passes a multiple of twice the bit
+        int shift = tac_bits[t->tac & 0x03] + 1;
+        Increment(t, ((t->system_counter + cycles) >> shift) - (t->system_counter >> shift));
     }
     t->system_counter += cycles;
-    if(TEST_BIT(t->tac, 2)){ // Bit 2 of TAC is the timer enable
-        t->timer_counter -= cycles;
-        if(t->timer_counter <= 0){
-            if(t->tima == 0xFF){
-                t->tima = t->tma;
-                Mem_RequestInterrupt(t->memory, IF_TIMER);
-            }
-            else{
-                t->tima++;
-            }
-            Timer_ResetCounter(t);
-        }
+    t->time = now;
+    Schedule(t);
+}
+
+void Timer_EndFrame(TIMER *t){
+    if(t != NULL){
+        Timer_CatchUp(t);
+        if(t->overflow != TIMER_NEVER)
+            t->overflow -= t->time;
+        t->time = 0;
     }
+}
 
-    Mem_ForceWrite(t->memory, DIV_ADDR, t->div);
-    Mem_WriteByte(t->memory, TIMA_ADDR, t->tima);
+BYTE Timer_ReadRegister(TIMER *t, WORD addr){
+    if(t == NULL)
+        return 0xFF;
+    Timer_CatchUp(t);
+    switch(addr){
+        case DIV_ADDR:
+            return t->system_counter >> 8;
+        case TIMA_ADDR:
+            return t->tima;
+        case TMA_ADDR:
+            return t->tma;
+        default:
+            // The top 5 bits of TAC aren't used and read as 1
+            return t->tac | 0xF8;
+    };
 }
 
-void Timer_ResetCounter(TIMER *t){
-    switch(t->tac & 0x03){
-        case 0: // 4096   Hz
-            t->timer_counter = 1024;
+void Timer_WriteRegister(TIMER *t, WORD addr, BYTE data){
+    if(t == NULL)
+        return;
+    // Everything up to now happened with the old value
+    Timer_CatchUp(t);
+    bool before = Signal(t);
+    switch(addr){
+        case DIV_ADDR:
+            // Any write clears the whole counter
+            t->system_counter = 0;
             break;
-        case 1: // 262144 Hz
-            t->timer_counter = 16;
+        case TIMA_ADDR:
+            t->tima = data;
             break;
-        case 2: // 65536  Hz
-            t->timer_counter = 64;
+        case TMA_ADDR:
+            t->tma = data;
             break;
-        case 3: // 16382 Hz
-            t->timer_counter = 256;
+        default:
+            t->tac = data & 0x07;
             break;
     };
-}
\ No newline at end of file
+    // Pulling the signal low is a falling edge like any other
+    if(before && !Signal(t))
+        Increment(t, 1);
+    Schedule(t);
+}
+
+// What TIMA counts the falling edges of: the selected bit, if it's enabled
+static bool Signal(TIMER *t){
+    return TEST_BIT(t->tac, 2) && ((t->system_counter >> tac_bits[t->tac & 0x03]) & 0x01);
+}
+
+// Adds count to TIMA. Every time it overflows it starts over from TMA, and
+// the interrupt is requested
+static void Increment(TIMER *t, unsigned int count){
+    if(count < 0x100u - t->tima){
+        t->tima += count;
+        return;
+    }
+    count -= 0x100 - t->tima;
+    t->tima = t->tma + count % (0x100u - t->tma);
+    Mem_RequestInterrupt(t->memory, IF_TIMER);
+}
+
+// Works out the cycle TIMA overflows at: 0x100 - TIMA more falling edges,
+// the first at the counter's next multiple of twice the bit, then one
+// every twice the bit
+static void Schedule(TIMER *t){
+    if(!TEST_BIT(t->tac, 2)){
+        t->overflow = TIMER_NEVER;
+        return;
+    }
+    unsigned int period = 2u << tac_bits[t->tac & 0x03];
+    unsigned int first = period - (t->system_counter & (period - 1));
+    t->overflow = t->time + first + (0xFFu - t->tima) * period;
+}